@@ -5,6 +5,10 @@
 #include <iostream>
 #include <fstream>
 #include <time.h>
+#include <string.h>
+#include <stddef.h>
+#include <chrono>
+#include <sys/stat.h>
 
 #if defined(__APPLE__)
 #include <GLUT/GLUT.h>
@@ -18,16 +22,66 @@
 #include <GL/freeglut.h>
 #endif
 
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// 4-wide float operations the vector and matrix math is written in:
+// SSE on x86 (AVX where enabled), NEON on ARM, plain loops otherwise or
+// when MATH_NO_SIMD is defined
+#if !defined(MATH_NO_SIMD) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define MATH_SSE
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#if defined(__AVX__)
+#define MATH_AVX
+#include <immintrin.h>
+#endif
+#elif !defined(MATH_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define MATH_NEON
+#include <arm_neon.h>
+#endif
+
 #include <string>
 #include <vector>
 #include <fstream>
 #include <algorithm>
+#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 const unsigned int windowWidth = 512, windowHeight = 512;
 
 int majorVersion = 3, minorVersion = 0;
 
-bool keyboardState[256];
-bool arrowKeyState[4];
+// written by the GLUT callbacks, sampled by the simulation thread
+std::atomic<bool> keyboardState[256];
+std::atomic<bool> arrowKeyState[4];
+
+// the keys as one tick sees them: copied once when the tick starts, from
+// the live state or from a replay, so a key the callbacks change while the
+// tick runs cannot reach only part of it. Keys 0-255 are keys, the arrow
+// keys follow
+struct InputState
+{
+    bool keys[256];
+    bool arrowKeys[4];
+    
+    InputState() : keys(), arrowKeys() {}
+    
+    bool& Key(int key) { return key < 256 ? keys[key] : arrowKeys[key - 256]; }
+    
+    void Sample()
+    {
+        for(int key = 0; key < 256; key++) keys[key] = keyboardState[key];
+        for(int key = 0; key < 4; key++) arrowKeys[key] = arrowKeyState[key];
+    }
+};
 double trackingT;
 int best_score;
 int score;
@@ -36,7 +90,35 @@ bool invincible;
 int visible;
 bool game_over;
 
-enum OBJECT_TYPE { TIGGER, GROUND, OBSTACLE, HEART, NONE };
+// obstacle cars on the road, set with --cars; they share the four lanes
+int carCount = 4;
+
+// the simulation advances in fixed ticks of 1 / tickRate seconds (--tick-rate),
+// velocities and rates are per second and scaled by the tick's length, so the
+// rate changes how finely the game is integrated, not how fast it plays;
+// a frame runs at most maxCatchUpTicks of them and drops the rest of a
+// backlog instead of falling further behind
+double tickRate = 60.0;
+const int maxCatchUpTicks = 5;
+
+// seeds the scene's random numbers (--seed); a run from the same seed and
+// the same input is the same run
+unsigned long long randomSeed;
+
+enum OBJECT_TYPE { TIGGER, GROUND, OBSTACLE, HEART, NONE, OBJECT_TYPE_COUNT };
+
+// the ordered type pairs Object::Interact has behavior for, [object][other];
+// reach is how far apart on the ground plane the pair can still interact,
+// 0 where distance does not matter (the ground is an infinite plane)
+struct InteractionRule { bool active; float reach; };
+
+constexpr InteractionRule interactionRules[OBJECT_TYPE_COUNT][OBJECT_TYPE_COUNT] = {
+    //             TIGGER          GROUND          OBSTACLE           HEART           NONE
+    /* TIGGER   */ { { false, 0 }, { true, 0 },    { true, 0.8f },    { false, 0 },   { false, 0 } },
+    /* GROUND   */ { { false, 0 }, { false, 0 },   { false, 0 },      { false, 0 },   { false, 0 } },
+    /* OBSTACLE */ { { false, 0 }, { false, 0 },   { false, 0 },      { false, 0 },   { false, 0 } },
+    /* HEART    */ { { false, 0 }, { false, 0 },   { false, 0 },      { false, 0 },   { false, 0 } },
+    /* NONE     */ { { false, 0 }, { false, 0 },   { false, 0 },      { false, 0 },   { false, 0 } } };
 
 void getErrorInfo(unsigned int handle)
 {
@@ -74,10 +156,62 @@ void checkLinking(unsigned int program)
     }
 }
 
-// row-major matrix 4x4
+#if defined(MATH_SSE)
+typedef __m128 float4;
+inline float4 Load4(const float* p) { return _mm_load_ps(p); }
+inline void Store4(float* p, float4 a) { _mm_store_ps(p, a); }
+inline float4 Splat4(float s) { return _mm_set1_ps(s); }
+inline float4 Add4(float4 a, float4 b) { return _mm_add_ps(a, b); }
+inline float4 Mul4(float4 a, float4 b) { return _mm_mul_ps(a, b); }
+inline float4 LoadUnaligned4(const float* p) { return _mm_loadu_ps(p); }
+inline void StoreUnaligned4(float* p, float4 a) { _mm_storeu_ps(p, a); }
+inline float4 Sub4(float4 a, float4 b) { return _mm_sub_ps(a, b); }
+inline float4 Div4(float4 a, float4 b) { return _mm_div_ps(a, b); }
+inline float4 Max4(float4 a, float4 b) { return _mm_max_ps(a, b); }
+inline float4 Truncate4(float4 a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a)); }
+#elif defined(MATH_NEON)
+typedef float32x4_t float4;
+inline float4 Load4(const float* p) { return vld1q_f32(p); }
+inline void Store4(float* p, float4 a) { vst1q_f32(p, a); }
+inline float4 Splat4(float s) { return vdupq_n_f32(s); }
+inline float4 Add4(float4 a, float4 b) { return vaddq_f32(a, b); }
+inline float4 Mul4(float4 a, float4 b) { return vmulq_f32(a, b); }
+inline float4 LoadUnaligned4(const float* p) { return vld1q_f32(p); }
+inline void StoreUnaligned4(float* p, float4 a) { vst1q_f32(p, a); }
+inline float4 Sub4(float4 a, float4 b) { return vsubq_f32(a, b); }
+#if defined(__aarch64__)
+inline float4 Div4(float4 a, float4 b) { return vdivq_f32(a, b); }
+#else
+inline float4 Div4(float4 a, float4 b)
+{
+    float x[4], y[4];
+    vst1q_f32(x, a);
+    vst1q_f32(y, b);
+    for(int i = 0; i < 4; i++) x[i] /= y[i];
+    return vld1q_f32(x);
+}
+#endif
+inline float4 Max4(float4 a, float4 b) { return vmaxq_f32(a, b); }
+inline float4 Truncate4(float4 a) { return vcvtq_f32_s32(vcvtq_s32_f32(a)); }
+#else
+struct float4 { float v[4]; };
+inline float4 Load4(const float* p) { float4 r; for(int i = 0; i < 4; i++) r.v[i] = p[i]; return r; }
+inline void Store4(float* p, float4 a) { for(int i = 0; i < 4; i++) p[i] = a.v[i]; }
+inline float4 Splat4(float s) { float4 r; for(int i = 0; i < 4; i++) r.v[i] = s; return r; }
+inline float4 Add4(float4 a, float4 b) { for(int i = 0; i < 4; i++) a.v[i] += b.v[i]; return a; }
+inline float4 Mul4(float4 a, float4 b) { for(int i = 0; i < 4; i++) a.v[i] *= b.v[i]; return a; }
+inline float4 LoadUnaligned4(const float* p) { return Load4(p); }
+inline void StoreUnaligned4(float* p, float4 a) { Store4(p, a); }
+inline float4 Sub4(float4 a, float4 b) { for(int i = 0; i < 4; i++) a.v[i] -= b.v[i]; return a; }
+inline float4 Div4(float4 a, float4 b) { for(int i = 0; i < 4; i++) a.v[i] /= b.v[i]; return a; }
+inline float4 Max4(float4 a, float4 b) { for(int i = 0; i < 4; i++) a.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i]; return a; }
+inline float4 Truncate4(float4 a) { for(int i = 0; i < 4; i++) a.v[i] = (float)(int)a.v[i]; return a; }
+#endif
+
+// row-major matrix 4x4, rows are 16-byte aligned for the 4-wide loads
 struct mat4
 {
-    float m[4][4];
+    alignas(16) float m[4][4];
 public:
     mat4() {}
     mat4(float m00, float m01, float m02, float m03,
@@ -91,19 +225,66 @@ public:
         m[3][0] = m30; m[3][1] = m31; m[3][2] = m32; m[3][3] = m33;
     }
     
-    mat4 operator*(const mat4& right)
+    // row i of the product is the rows of right weighted by row i of this;
+    // the sums run in the same order as the scalar loop, so the result is
+    // bit-identical to it (no fused multiply-add)
+    mat4 operator*(const mat4& right) const
     {
         mat4 result;
+#if defined(MATH_AVX)
+        // two result rows per 256-bit register
+        __m256 r0 = _mm256_broadcast_ps((const __m128*)right.m[0]);
+        __m256 r1 = _mm256_broadcast_ps((const __m128*)right.m[1]);
+        __m256 r2 = _mm256_broadcast_ps((const __m128*)right.m[2]);
+        __m256 r3 = _mm256_broadcast_ps((const __m128*)right.m[3]);
+        for (int i = 0; i < 4; i += 2)
+        {
+            __m256 row = _mm256_mul_ps(_mm256_setr_m128(_mm_set1_ps(m[i][0]), _mm_set1_ps(m[i + 1][0])), r0);
+            row = _mm256_add_ps(row, _mm256_mul_ps(_mm256_setr_m128(_mm_set1_ps(m[i][1]), _mm_set1_ps(m[i + 1][1])), r1));
+            row = _mm256_add_ps(row, _mm256_mul_ps(_mm256_setr_m128(_mm_set1_ps(m[i][2]), _mm_set1_ps(m[i + 1][2])), r2));
+            row = _mm256_add_ps(row, _mm256_mul_ps(_mm256_setr_m128(_mm_set1_ps(m[i][3]), _mm_set1_ps(m[i + 1][3])), r3));
+            _mm256_store_ps(result.m[i], row);
+        }
+#else
+        float4 r0 = Load4(right.m[0]), r1 = Load4(right.m[1]), r2 = Load4(right.m[2]), r3 = Load4(right.m[3]);
         for (int i = 0; i < 4; i++)
         {
-            for (int j = 0; j < 4; j++)
-            {
-                result.m[i][j] = 0;
-                for (int k = 0; k < 4; k++) result.m[i][j] += m[i][k] * right.m[k][j];
-            }
+            float4 row = Mul4(Splat4(m[i][0]), r0);
+            row = Add4(row, Mul4(Splat4(m[i][1]), r1));
+            row = Add4(row, Mul4(Splat4(m[i][2]), r2));
+            row = Add4(row, Mul4(Splat4(m[i][3]), r3));
+            Store4(result.m[i], row);
         }
+#endif
+        return result;
+    }
+    
+    // inverse of a matrix whose last column is (0, 0, 0, 1): the 3x3 block
+    // is inverted by cofactors, the translation row follows from it
+    mat4 AffineInverse() const
+    {
+        float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+        float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+        float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+        float invDet = 1.0f / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+        
+        mat4 result;
+        result.m[0][0] = c00 * invDet;
+        result.m[1][0] = c01 * invDet;
+        result.m[2][0] = c02 * invDet;
+        result.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+        result.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+        result.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+        result.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+        result.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+        result.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+        for (int j = 0; j < 3; j++)
+            result.m[3][j] = -(m[3][0] * result.m[0][j] + m[3][1] * result.m[1][j] + m[3][2] * result.m[2][j]);
+        result.m[0][3] = result.m[1][3] = result.m[2][3] = 0;
+        result.m[3][3] = 1;
         return result;
     }
+    
     operator float*() { return &m[0][0]; }
 };
 
@@ -111,27 +292,28 @@ public:
 // 3D point in homogeneous coordinates
 struct vec4
 {
-    float v[4];
+    alignas(16) float v[4];
     
     vec4(float x = 0, float y = 0, float z = 0, float w = 1)
     {
         v[0] = x; v[1] = y; v[2] = z; v[3] = w;
     }
     
-    vec4 operator*(const mat4& mat)
+    vec4 operator*(const mat4& mat) const
     {
         vec4 result;
-        for (int j = 0; j < 4; j++)
-        {
-            result.v[j] = 0;
-            for (int i = 0; i < 4; i++) result.v[j] += v[i] * mat.m[i][j];
-        }
+        float4 row = Mul4(Splat4(v[0]), Load4(mat.m[0]));
+        row = Add4(row, Mul4(Splat4(v[1]), Load4(mat.m[1])));
+        row = Add4(row, Mul4(Splat4(v[2]), Load4(mat.m[2])));
+        row = Add4(row, Mul4(Splat4(v[3]), Load4(mat.m[3])));
+        Store4(result.v, row);
         return result;
     }
     
-    vec4 operator+(const vec4& vec)
+    vec4 operator+(const vec4& vec) const
     {
-        vec4 result(v[0] + vec.v[0], v[1] + vec.v[1], v[2] + vec.v[2], v[3] + vec.v[3]);
+        vec4 result;
+        Store4(result.v, Add4(Load4(v), Load4(vec.v)));
         return result;
     }
 };
@@ -155,7 +337,8 @@ struct vec2
     
 };
 
-// 3D point in Cartesian coordinates
+// 3D point in Cartesian coordinates, packed: arrays of them are walked as
+// plain float arrays
 struct vec3
 {
     float x, y, z;
@@ -174,6 +357,10 @@ struct vec3
     
     vec3 operator/(float s) { return vec3(x / s, y / s, z / s); }
     
+    bool operator==(const vec3& v) const { return x == v.x && y == v.y && z == v.z; }
+    
+    bool operator!=(const vec3& v) const { return !(*this == v); }
+    
     float length() { return sqrt(x * x + y * y + z * z); }
     
     vec3 normalize() { return *this / length(); }
@@ -181,6 +368,8 @@ struct vec3
     void print() { printf("%f \t %f \t %f \n", x, y, z); }
 };
 
+static_assert(sizeof(vec3) == 3 * sizeof(float), "vec3 arrays are processed as float arrays");
+
 vec3 cross(const vec3& a, const vec3& b)
 {
     return vec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x );
@@ -196,503 +385,2036 @@ vec3 elementWise(const vec3& a, const vec3& b)
     return vec3(a.x*b.x, a.y*b.y, a.z*b.z);
 }
 
-
-
-
-class Geometry
+// PCG32 (O'Neill): 64-bit linear congruential state, output permuted by an
+// xorshift and a state-dependent rotation. Small, fast and the same on every
+// platform, unlike rand(), so a seed reproduces a run exactly
+struct Random
 {
-protected:
-    unsigned int vao;
+    unsigned long long state, increment;
     
-public:
-    Geometry()
+    Random(unsigned long long seed = 1) { Seed(seed); }
+    
+    void Seed(unsigned long long seed, unsigned long long sequence = 54)
     {
-        glGenVertexArrays(1, &vao);
+        state = 0;
+        increment = (sequence << 1) | 1;
+        Next();
+        state += seed;
+        Next();
+    }
+    
+    unsigned int Next()
+    {
+        unsigned long long old = state;
+        state = old * 6364136223846793005ULL + increment;
+        unsigned int xorshifted = (unsigned int)(((old >> 18) ^ old) >> 27);
+        unsigned int rotation = (unsigned int)(old >> 59);
+        return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
     }
     
-    virtual void Draw() = 0;
+    // uniform in [0, n), without the bias of Next() % n
+    int NextInt(int n)
+    {
+        unsigned int threshold = (0u - (unsigned int)n) % (unsigned int)n;
+        unsigned int r;
+        do r = Next(); while(r < threshold);
+        return r % n;
+    }
 };
 
+// 64-bit FNV-1a, for fingerprinting the simulation state
+const unsigned long long hashBasis = 14695981039346656037ULL;
 
-class   PolygonalMesh : public Geometry
+unsigned long long HashBytes(unsigned long long hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for(size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    return hash;
+}
+
+// S * Rx * Ry * Rz * T with the angles in degrees, multiplied out in closed
+// form: one sin/cos per axis instead of five matrix products
+mat4 ScaleRotationTranslation(const vec3& scaling, const vec3& orientation, const vec3& position)
 {
-    struct  Face
+    float ax = orientation.x / 180.0 * M_PI, ay = orientation.y / 180.0 * M_PI, az = orientation.z / 180.0 * M_PI;
+    float cx = cos(ax), sx = sin(ax);
+    float cy = cos(ay), sy = sin(ay);
+    float cz = cos(az), sz = sin(az);
+    
+    return mat4(
+                scaling.x * cy * cz,                  scaling.x * cy * sz,                  scaling.x * sy,       0.0,
+                scaling.y * (-sx * sy * cz - cx * sz), scaling.y * (cx * cz - sx * sy * sz), scaling.y * sx * cy,  0.0,
+                scaling.z * (sx * sz - cx * sy * cz),  scaling.z * (-cx * sy * sz - sx * cz), scaling.z * cx * cy, 0.0,
+                position.x,                           position.y,                           position.z,           1.0);
+}
+
+
+
+
+// the GL state main.cpp changes, as last set by this program. Every program,
+// vertex array, texture, buffer, framebuffer, viewport and capability change goes through glState,
+// which drops the ones that would set what is already set and counts them
+// per frame. Nothing is known before the first call, so that one always
+// reaches GL. Only the render thread may use it, like GL itself.
+enum GL_CAPABILITY { DEPTH_TEST_CAPABILITY, BLEND_CAPABILITY, CULL_FACE_CAPABILITY, POLYGON_OFFSET_FILL_CAPABILITY, GL_CAPABILITY_COUNT };
+
+// the buffer targets whose binding is not part of a vertex array
+enum GL_BUFFER_TARGET { ARRAY_BUFFER_TARGET, UNIFORM_BUFFER_TARGET, GL_BUFFER_TARGET_COUNT };
+
+#define GL_STATE_TEXTURE_UNITS 8
+#define GL_STATE_UNIFORM_BINDINGS 8
+
+struct GLStateStats
+{
+    int issued, filtered;
+};
+
+class GLState
+{
+    static const unsigned int unknown = ~0u;
+    
+    unsigned int program;
+    unsigned int vertexArray;
+    unsigned int activeTexture;
+    unsigned int textures[GL_STATE_TEXTURE_UNITS];
+    unsigned int buffers[GL_BUFFER_TARGET_COUNT];
+    int capabilities[GL_CAPABILITY_COUNT];
+    unsigned int blendSource, blendDestination;
+    int depthMask;
+    unsigned int framebuffer;
+    int viewport[4];
+    
+    // the ranges bound to the uniform block bindings
+    struct UniformRange
     {
-        int       positionIndices[4];
-        int       normalIndices[4];
-        int       texcoordIndices[4];
-        bool      isQuad;
+        unsigned int buffer;
+        long long offset, size;
     };
+    UniformRange uniformRanges[GL_STATE_UNIFORM_BINDINGS];
     
-    std::vector<std::string*> rows;
-    std::vector<vec3*> positions;
-    std::vector<std::vector<Face*>> submeshFaces;
-    std::vector<vec3*> normals;
-    std::vector<vec2*> texcoords;
+    GLStateStats stats;
     
-    int nTriangles;
+    // true when the call has to reach GL
+    bool Change(unsigned int& cached, unsigned int value)
+    {
+        if(cached == value)
+        {
+            stats.filtered++;
+            return false;
+        }
+        cached = value;
+        stats.issued++;
+        return true;
+    }
     
 public:
-    PolygonalMesh(const char *filename);
-    ~PolygonalMesh();
-    
-    void Draw();
-};
-
-class TexturedQuad : public Geometry
-{
-    unsigned int vbo[3];
+    GLState()
+    {
+        Invalidate();
+        memset(&stats, 0, sizeof(stats));
+    }
     
-public:
-    TexturedQuad()
+    // forgets everything, for when GL state was changed behind the cache
+    void Invalidate()
     {
-        glBindVertexArray(vao);
-        glGenBuffers(3, vbo);
-        
-        // define the texture coordinates here
-        // assign the array of texture coordinates to
-        // vertex attribute array 1
-        glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-        static float vertexCoords[] = {0,-1,0,    -1,-1,-1,     -1,-1,1,     1,-1,1,     1,-1,-1,     -1,-1,-1};
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-        
-        
-        glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-        static float vertexTextureCoords[] = {0.5,0.5,    0,0,    0,1,    1,1,     1,0,   0,0};
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexTextureCoords), vertexTextureCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-        
-        
-        glBindBuffer(GL_ARRAY_BUFFER, vbo[2]);
-        static float vertexNormalCoords[] = {0,1,0,      0,1,0,      0,1,0,       0,1,0,      0,1,0,     0,1,0};
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexNormalCoords), vertexNormalCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+        program = vertexArray = activeTexture = unknown;
+        for(int i = 0; i < GL_STATE_TEXTURE_UNITS; i++) textures[i] = unknown;
+        for(int i = 0; i < GL_BUFFER_TARGET_COUNT; i++) buffers[i] = unknown;
+        for(int i = 0; i < GL_CAPABILITY_COUNT; i++) capabilities[i] = -1;
+        blendSource = blendDestination = unknown;
+        depthMask = -1;
+        framebuffer = unknown;
+        viewport[2] = -1;
+        for(int i = 0; i < GL_STATE_UNIFORM_BINDINGS; i++) uniformRanges[i].buffer = unknown;
     }
     
-    void Draw()
+    void BeginFrame() { memset(&stats, 0, sizeof(stats)); }
+    
+    const GLStateStats& GetStats() { return stats; }
+    
+    void UseProgram(unsigned int p)
     {
-        glEnable(GL_DEPTH_TEST);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 6);
-        glDisable(GL_DEPTH_TEST);
+        if(Change(program, p)) glUseProgram(p);
     }
-};
-
-class InfiniteTexturedQuad : public Geometry
-{
-    unsigned int vbo[3];
     
-public:
-    InfiniteTexturedQuad()
+    // a deleted program may come back under the same name
+    void DeleteProgram(unsigned int p)
     {
-        glBindVertexArray(vao);
-        glGenBuffers(3, vbo);
-        
-        // define the texture coordinates here
-        // assign the array of texture coordinates to
-        // vertex attribute array 1
-        float y = 0;
-        float w = 0;
-        glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-        static float vertexCoords[] = {0,y,0,1,    -1,y,-1,w,     -1,y,1,w,     1,y,1,w,     1,y,-1,w,     -1,y,-1,w};
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, NULL);
-        
-        
-        glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-        static float vertexTextureCoords[] = {0.5,0.5,    0,0,    0,1,    1,1,     1,0,   0,0};
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexTextureCoords), vertexTextureCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-        
-        
-        glBindBuffer(GL_ARRAY_BUFFER, vbo[2]);
-        static float vertexNormalCoords[] = {0,1,0,      0,1,0,      0,1,0,       0,1,0,      0,1,0,     0,1,0};
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexNormalCoords), vertexNormalCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+        if(program == p) program = unknown;
+        glDeleteProgram(p);
     }
     
-    void Draw()
+    void BindVertexArray(unsigned int vao)
     {
-        glEnable(GL_DEPTH_TEST);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 6);
-        glDisable(GL_DEPTH_TEST);
+        if(Change(vertexArray, vao)) glBindVertexArray(vao);
     }
-};
-
-
-PolygonalMesh::PolygonalMesh(const char *filename)
-{
-    std::fstream file(filename);
-    if(!file.is_open())
+    
+    void BindTexture(unsigned int unit, unsigned int texture)
     {
-        return;
+        if(Change(activeTexture, unit)) glActiveTexture(GL_TEXTURE0 + unit);
+        if(Change(textures[unit], texture)) glBindTexture(GL_TEXTURE_2D, texture);
     }
     
-    char buffer[256];
-    while(!file.eof())
+    void BindBuffer(GL_BUFFER_TARGET target, unsigned int buffer)
     {
-        file.getline(buffer,256);
-        rows.push_back(new std::string(buffer));
+        static const unsigned int targets[GL_BUFFER_TARGET_COUNT] = { GL_ARRAY_BUFFER, GL_UNIFORM_BUFFER };
+        if(Change(buffers[target], buffer)) glBindBuffer(targets[target], buffer);
     }
     
-    submeshFaces.push_back(std::vector<Face*>());
-    std::vector<Face*>* faces = &submeshFaces.at(submeshFaces.size()-1);
+    void DeleteBuffer(unsigned int buffer)
+    {
+        for(int i = 0; i < GL_BUFFER_TARGET_COUNT; i++) if(buffers[i] == buffer) buffers[i] = unknown;
+        for(int i = 0; i < GL_STATE_UNIFORM_BINDINGS; i++) if(uniformRanges[i].buffer == buffer) uniformRanges[i].buffer = unknown;
+        glDeleteBuffers(1, &buffer);
+    }
     
-    for(int i = 0; i < rows.size(); i++)
+    // binding a range also binds the buffer to the generic uniform buffer target
+    void BindUniformRange(unsigned int binding, unsigned int buffer, long long offset, long long size)
     {
-        if(rows[i]->empty() || (*rows[i])[0] == '#')
-            continue;
-        else if((*rows[i])[0] == 'v' && (*rows[i])[1] == ' ')
-        {
-            float tmpx,tmpy,tmpz;
-            sscanf(rows[i]->c_str(), "v %f %f %f" ,&tmpx,&tmpy,&tmpz);
-            positions.push_back(new vec3(tmpx,tmpy,tmpz));
-        }
-        else if((*rows[i])[0] == 'v' && (*rows[i])[1] == 'n')
+        UniformRange& range = uniformRanges[binding];
+        buffers[UNIFORM_BUFFER_TARGET] = buffer;
+        if(range.buffer == buffer && range.offset == offset && range.size == size)
         {
-            float tmpx,tmpy,tmpz;
-            sscanf(rows[i]->c_str(), "vn %f %f %f" ,&tmpx,&tmpy,&tmpz);
-            normals.push_back(new vec3(tmpx,tmpy,tmpz));
-        }
-        else if((*rows[i])[0] == 'v' && (*rows[i])[1] == 't')
-        {
-            float tmpx,tmpy;
-            sscanf(rows[i]->c_str(), "vt %f %f" ,&tmpx,&tmpy);
-            texcoords.push_back(new vec2(tmpx,tmpy));
+            stats.filtered++;
+            return;
         }
-        else if((*rows[i])[0] == 'f')
+        range.buffer = buffer;
+        range.offset = offset;
+        range.size = size;
+        stats.issued++;
+        glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, (GLintptr)offset, (GLsizeiptr)size);
+    }
+    
+    void SetCapability(GL_CAPABILITY capability, bool enabled)
+    {
+        static const unsigned int names[GL_CAPABILITY_COUNT] = { GL_DEPTH_TEST, GL_BLEND, GL_CULL_FACE, GL_POLYGON_OFFSET_FILL };
+        if(capabilities[capability] == (int)enabled)
         {
-            if(count(rows[i]->begin(),rows[i]->end(), ' ') == 3)
-            {
-                Face* f = new Face();
-                f->isQuad = false;
-                sscanf(rows[i]->c_str(), "f %d/%d/%d %d/%d/%d %d/%d/%d",
-                       &f->positionIndices[0], &f->texcoordIndices[0], &f->normalIndices[0],
-                       &f->positionIndices[1], &f->texcoordIndices[1], &f->normalIndices[1],
-                       &f->positionIndices[2], &f->texcoordIndices[2], &f->normalIndices[2]);
-                faces->push_back(f);
-            }
-            else
-            {
-                Face* f = new Face();
-                f->isQuad = true;
-                sscanf(rows[i]->c_str(), "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d",
-                       &f->positionIndices[0], &f->texcoordIndices[0], &f->normalIndices[0],
-                       &f->positionIndices[1], &f->texcoordIndices[1], &f->normalIndices[1],
-                       &f->positionIndices[2], &f->texcoordIndices[2], &f->normalIndices[2],
-                       &f->positionIndices[3], &f->texcoordIndices[3], &f->normalIndices[3]);
-                faces->push_back(f);
-            }
+            stats.filtered++;
+            return;
         }
-        else if((*rows[i])[0] == 'g')
+        capabilities[capability] = enabled;
+        stats.issued++;
+        if(enabled) glEnable(names[capability]);
+        else glDisable(names[capability]);
+    }
+    
+    void BlendFunc(unsigned int source, unsigned int destination)
+    {
+        if(blendSource == source && blendDestination == destination)
         {
-            if(faces->size() > 0)
-            {
-                submeshFaces.push_back(std::vector<Face*>());
-                faces = &submeshFaces.at(submeshFaces.size()-1);
-            }
+            stats.filtered++;
+            return;
         }
+        blendSource = source;
+        blendDestination = destination;
+        stats.issued++;
+        glBlendFunc(source, destination);
     }
     
-    int numberOfTriangles = 0;
-    for(int iSubmesh=0; iSubmesh<submeshFaces.size(); iSubmesh++)
+    void DepthMask(bool write)
     {
-        std::vector<Face*>& faces = submeshFaces.at(iSubmesh);
-        
-        for(int i=0;i<faces.size();i++)
+        if(depthMask == (int)write)
         {
-            if(faces[i]->isQuad) numberOfTriangles += 2;
-            else numberOfTriangles += 1;
+            stats.filtered++;
+            return;
         }
+        depthMask = write;
+        stats.issued++;
+        glDepthMask(write ? GL_TRUE : GL_FALSE);
     }
     
-    nTriangles = numberOfTriangles;
-    
-    float *vertexCoords = new float[numberOfTriangles * 9];
-    float *vertexTexCoords = new float[numberOfTriangles * 6];
-    float *vertexNormalCoords = new float[numberOfTriangles * 9];
-    
+    void BindFramebuffer(unsigned int fbo)
+    {
+        if(Change(framebuffer, fbo)) glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    }
     
-    int triangleIndex = 0;
-    for(int iSubmesh=0; iSubmesh<submeshFaces.size(); iSubmesh++)
+    // the bound framebuffer, asked from GL while nothing has been set through the cache
+    unsigned int GetFramebuffer()
     {
-        std::vector<Face*>& faces = submeshFaces.at(iSubmesh);
-        
-        for(int i=0;i<faces.size();i++)
+        if(framebuffer == unknown)
         {
-            if(faces[i]->isQuad)
-            {
-                vertexTexCoords[triangleIndex * 6] =     texcoords[faces[i]->texcoordIndices[0]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 1] = 1-texcoords[faces[i]->texcoordIndices[0]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 2] = texcoords[faces[i]->texcoordIndices[1]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 3] = 1-texcoords[faces[i]->texcoordIndices[1]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 4] = texcoords[faces[i]->texcoordIndices[2]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 5] = 1-texcoords[faces[i]->texcoordIndices[2]-1]->y;
-                
-                
-                vertexCoords[triangleIndex * 9] =     positions[faces[i]->positionIndices[0]-1]->x;
-                vertexCoords[triangleIndex * 9 + 1] = positions[faces[i]->positionIndices[0]-1]->y;
-                vertexCoords[triangleIndex * 9 + 2] = positions[faces[i]->positionIndices[0]-1]->z;
-                
-                vertexCoords[triangleIndex * 9 + 3] = positions[faces[i]->positionIndices[1]-1]->x;
-                vertexCoords[triangleIndex * 9 + 4] = positions[faces[i]->positionIndices[1]-1]->y;
-                vertexCoords[triangleIndex * 9 + 5] = positions[faces[i]->positionIndices[1]-1]->z;
-                
-                vertexCoords[triangleIndex * 9 + 6] = positions[faces[i]->positionIndices[2]-1]->x;
-                vertexCoords[triangleIndex * 9 + 7] = positions[faces[i]->positionIndices[2]-1]->y;
-                vertexCoords[triangleIndex * 9 + 8] = positions[faces[i]->positionIndices[2]-1]->z;
-                
-                
-                vertexNormalCoords[triangleIndex * 9] =     normals[faces[i]->normalIndices[0]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 1] = normals[faces[i]->normalIndices[0]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 2] = normals[faces[i]->normalIndices[0]-1]->z;
-                
-                vertexNormalCoords[triangleIndex * 9 + 3] = normals[faces[i]->normalIndices[1]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 4] = normals[faces[i]->normalIndices[1]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 5] = normals[faces[i]->normalIndices[1]-1]->z;
-                
-                vertexNormalCoords[triangleIndex * 9 + 6] = normals[faces[i]->normalIndices[2]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 7] = normals[faces[i]->normalIndices[2]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 8] = normals[faces[i]->normalIndices[2]-1]->z;
-                
-                triangleIndex++;
-                
-                
-                vertexTexCoords[triangleIndex * 6] =     texcoords[faces[i]->texcoordIndices[1]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 1] = 1-texcoords[faces[i]->texcoordIndices[1]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 2] = texcoords[faces[i]->texcoordIndices[2]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 3] = 1-texcoords[faces[i]->texcoordIndices[2]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 4] = texcoords[faces[i]->texcoordIndices[3]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 5] = 1-texcoords[faces[i]->texcoordIndices[3]-1]->y;
-                
-                
-                vertexCoords[triangleIndex * 9] =     positions[faces[i]->positionIndices[1]-1]->x;
-                vertexCoords[triangleIndex * 9 + 1] = positions[faces[i]->positionIndices[1]-1]->y;
-                vertexCoords[triangleIndex * 9 + 2] = positions[faces[i]->positionIndices[1]-1]->z;
-                
-                vertexCoords[triangleIndex * 9 + 3] = positions[faces[i]->positionIndices[2]-1]->x;
-                vertexCoords[triangleIndex * 9 + 4] = positions[faces[i]->positionIndices[2]-1]->y;
-                vertexCoords[triangleIndex * 9 + 5] = positions[faces[i]->positionIndices[2]-1]->z;
-                
-                vertexCoords[triangleIndex * 9 + 6] = positions[faces[i]->positionIndices[3]-1]->x;
-                vertexCoords[triangleIndex * 9 + 7] = positions[faces[i]->positionIndices[3]-1]->y;
-                vertexCoords[triangleIndex * 9 + 8] = positions[faces[i]->positionIndices[3]-1]->z;
-                
-                
-                vertexNormalCoords[triangleIndex * 9] =     normals[faces[i]->normalIndices[1]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 1] = normals[faces[i]->normalIndices[1]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 2] = normals[faces[i]->normalIndices[1]-1]->z;
-                
-                vertexNormalCoords[triangleIndex * 9 + 3] = normals[faces[i]->normalIndices[2]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 4] = normals[faces[i]->normalIndices[2]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 5] = normals[faces[i]->normalIndices[2]-1]->z;
-                
-                vertexNormalCoords[triangleIndex * 9 + 6] = normals[faces[i]->normalIndices[3]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 7] = normals[faces[i]->normalIndices[3]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 8] = normals[faces[i]->normalIndices[3]-1]->z;
-                
-                triangleIndex++;
-            }
-            else
-            {
-                vertexTexCoords[triangleIndex * 6] =     texcoords[faces[i]->texcoordIndices[0]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 1] = 1-texcoords[faces[i]->texcoordIndices[0]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 2] = texcoords[faces[i]->texcoordIndices[1]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 3] = 1-texcoords[faces[i]->texcoordIndices[1]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 4] = texcoords[faces[i]->texcoordIndices[2]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 5] = 1-texcoords[faces[i]->texcoordIndices[2]-1]->y;
-                
-                vertexCoords[triangleIndex * 9] =     positions[faces[i]->positionIndices[0]-1]->x;
-                vertexCoords[triangleIndex * 9 + 1] = positions[faces[i]->positionIndices[0]-1]->y;
-                vertexCoords[triangleIndex * 9 + 2] = positions[faces[i]->positionIndices[0]-1]->z;
-                
-                vertexCoords[triangleIndex * 9 + 3] = positions[faces[i]->positionIndices[1]-1]->x;
-                vertexCoords[triangleIndex * 9 + 4] = positions[faces[i]->positionIndices[1]-1]->y;
-                vertexCoords[triangleIndex * 9 + 5] = positions[faces[i]->positionIndices[1]-1]->z;
-                
-                vertexCoords[triangleIndex * 9 + 6] = positions[faces[i]->positionIndices[2]-1]->x;
-                vertexCoords[triangleIndex * 9 + 7] = positions[faces[i]->positionIndices[2]-1]->y;
-                vertexCoords[triangleIndex * 9 + 8] = positions[faces[i]->positionIndices[2]-1]->z;
-                
-                
-                vertexNormalCoords[triangleIndex * 9] =     normals[faces[i]->normalIndices[0]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 1] = normals[faces[i]->normalIndices[0]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 2] = normals[faces[i]->normalIndices[0]-1]->z;
-                
-                vertexNormalCoords[triangleIndex * 9 + 3] = normals[faces[i]->normalIndices[1]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 4] = normals[faces[i]->normalIndices[1]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 5] = normals[faces[i]->normalIndices[1]-1]->z;
-                
-                vertexNormalCoords[triangleIndex * 9 + 6] = normals[faces[i]->normalIndices[2]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 7] = normals[faces[i]->normalIndices[2]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 8] = normals[faces[i]->normalIndices[2]-1]->z;
-                
-                triangleIndex++;
-            }
+            int bound = 0;
+            glGetIntegerv(GL_FRAMEBUFFER_BINDING, &bound);
+            framebuffer = bound;
         }
+        return framebuffer;
     }
     
-    glBindVertexArray(vao);
-    
-    unsigned int vbo[3];
-    glGenBuffers(3, &vbo[0]);
-    
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-    glBufferData(GL_ARRAY_BUFFER, nTriangles * 9 * sizeof(float), vertexCoords, GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-    
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-    glBufferData(GL_ARRAY_BUFFER, nTriangles * 6 * sizeof(float), vertexTexCoords, GL_STATIC_DRAW);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-    
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[2]);
-    glBufferData(GL_ARRAY_BUFFER, nTriangles * 9 * sizeof(float), vertexNormalCoords, GL_STATIC_DRAW);
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+    void Viewport(int x, int y, int width, int height)
+    {
+        if(viewport[0] == x && viewport[1] == y && viewport[2] == width && viewport[3] == height)
+        {
+            stats.filtered++;
+            return;
+        }
+        viewport[0] = x; viewport[1] = y; viewport[2] = width; viewport[3] = height;
+        stats.issued++;
+        glViewport(x, y, width, height);
+    }
     
-    delete vertexCoords;
-    delete vertexTexCoords;
-    delete vertexNormalCoords;
-}
+    void GetViewport(int* v)
+    {
+        if(viewport[2] < 0) glGetIntegerv(GL_VIEWPORT, viewport);
+        memcpy(v, viewport, sizeof(viewport));
+    }
+};
+
+GLState glState;
 
 
-void PolygonalMesh::Draw()
+// interleaved vertex layout shared by every Geometry, the vertex buffer and the mesh cache
+struct MeshVertex
 {
-    glEnable(GL_DEPTH_TEST);
-    glBindVertexArray(vao);
-    glDrawArrays(GL_TRIANGLES, 0, nTriangles * 3);
-    glDisable(GL_DEPTH_TEST);
-}
+    float position[3];
+    float texcoord[2];
+    float normal[3];
+};
+
+// the same vertex in 20 instead of 32 bytes: half-float texture coordinates
+// and a signed normalized 10:10:10:2 normal
+struct PackedVertex
+{
+    float position[3];
+    unsigned short texcoord[2];
+    unsigned int normal;
+};
+
+enum VERTEX_FORMAT { FLOAT_VERTEX, PACKED_VERTEX };
 
+// vertex format of the scene geometry, --packed-vertices selects PACKED_VERTEX
+VERTEX_FORMAT sceneVertexFormat = FLOAT_VERTEX;
 
-PolygonalMesh::~PolygonalMesh()
+unsigned short FloatToHalf(float f)
 {
-    for(unsigned int i = 0; i < rows.size(); i++) delete rows[i];
-    for(unsigned int i = 0; i < positions.size(); i++) delete positions[i];
-    for(unsigned int i = 0; i < submeshFaces.size(); i++)
-        for(unsigned int j = 0; j < submeshFaces.at(i).size(); j++)
-            delete submeshFaces.at(i).at(j);
-    for(unsigned int i = 0; i < normals.size(); i++) delete normals[i];
-    for(unsigned int i = 0; i < texcoords.size(); i++) delete texcoords[i];
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(bits));
+
+    unsigned int sign = (bits >> 16) & 0x8000;
+    int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+    unsigned int mantissa = bits & 0x7fffff;
+
+    if(exponent <= 0) return (unsigned short)sign;  // too small, flushed to zero
+    if(exponent >= 31) return (unsigned short)(sign | 0x7c00);  // too large, infinity
+
+    // round to nearest, a carry into the exponent is still the correct result
+    return (unsigned short)((sign | (exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1));
 }
 
+unsigned int PackNormal(const float* n)
+{
+    unsigned int packed = 0;
+    for(int i = 0; i < 3; i++)
+    {
+        float c = n[i] < -1 ? -1 : (n[i] > 1 ? 1 : n[i]);
+        int value = (int)floor(c * 511.0f + 0.5f);
+        packed |= ((unsigned int)value & 0x3ff) << (i * 10);
+    }
+    return packed;
+}
 
 
-class Shader
+// object-space bounds of a geometry: its axis-aligned box and a sphere
+// around the box center; a negative radius marks unbounded geometry
+struct BoundingVolume
+{
+    vec3 min, max;
+    vec3 center;
+    float radius;
+};
+
+class Geometry
 {
 protected:
-    unsigned int shaderProgram;
+    unsigned int vao;
+    VERTEX_FORMAT vertexFormat;
+    BoundingVolume bounds;
     
-public:
-    Shader()
+    void ComputeBounds(const MeshVertex* vertices, int nVertices)
     {
-        shaderProgram = 0;
+        if(nVertices == 0)
+        {
+            bounds.min = bounds.max = bounds.center = vec3();
+            bounds.radius = 0;
+            return;
+        }
+        
+        bounds.min = bounds.max = vec3(vertices[0].position[0], vertices[0].position[1], vertices[0].position[2]);
+        for(int i = 1; i < nVertices; i++)
+        {
+            const float* p = vertices[i].position;
+            bounds.min = vec3(std::min(bounds.min.x, p[0]), std::min(bounds.min.y, p[1]), std::min(bounds.min.z, p[2]));
+            bounds.max = vec3(std::max(bounds.max.x, p[0]), std::max(bounds.max.y, p[1]), std::max(bounds.max.z, p[2]));
+        }
+        
+        bounds.center = (bounds.min + bounds.max) * 0.5f;
+        float radius2 = 0;
+        for(int i = 0; i < nVertices; i++)
+        {
+            vec3 d = vec3(vertices[i].position[0], vertices[i].position[1], vertices[i].position[2]) - bounds.center;
+            radius2 = std::max(radius2, dot(d, d));
+        }
+        bounds.radius = sqrt(radius2);
     }
-    
-    ~Shader()
+
+    // uploads the vertices into a single interleaved buffer of the vao,
+    // packing them first when the geometry was created with PACKED_VERTEX,
+    // and bounds them
+    void UploadVertices(const MeshVertex* vertices, int nVertices)
     {
-        if(shaderProgram) glDeleteProgram(shaderProgram);
+        ComputeBounds(vertices, nVertices);
+        
+        glState.BindVertexArray(vao);
+
+        unsigned int vbo;
+        glGenBuffers(1, &vbo);
+        glState.BindBuffer(ARRAY_BUFFER_TARGET, vbo);
+
+        if(vertexFormat == PACKED_VERTEX)
+        {
+            std::vector<PackedVertex> packed(nVertices);
+            for(int i = 0; i < nVertices; i++)
+            {
+                memcpy(packed[i].position, vertices[i].position, sizeof(packed[i].position));
+                packed[i].texcoord[0] = FloatToHalf(vertices[i].texcoord[0]);
+                packed[i].texcoord[1] = FloatToHalf(vertices[i].texcoord[1]);
+                packed[i].normal = PackNormal(vertices[i].normal);
+            }
+            glBufferData(GL_ARRAY_BUFFER, nVertices * sizeof(PackedVertex), packed.data(), GL_STATIC_DRAW);
+
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, position));
+
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, texcoord));
+
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, normal));
+        }
+        else
+        {
+            glBufferData(GL_ARRAY_BUFFER, nVertices * sizeof(MeshVertex), vertices, GL_STATIC_DRAW);
+
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, position));
+
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, texcoord));
+
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void*)offsetof(MeshVertex, normal));
+        }
     }
-    
-    void Run()
+
+public:
+    Geometry(VERTEX_FORMAT format = FLOAT_VERTEX)
     {
-        if(shaderProgram) glUseProgram(shaderProgram);
+        vertexFormat = format;
+        bounds.radius = -1;
+        glGenVertexArrays(1, &vao);
     }
+
+    int VertexSize() { return vertexFormat == PACKED_VERTEX ? sizeof(PackedVertex) : sizeof(MeshVertex); }
+
+    // draws the given level of detail nInstances times in one call,
+    // shaders tell the instances apart by gl_InstanceID
+    virtual void DrawInstanced(int lod, int nInstances) = 0;
     
-    virtual void UploadInvM(mat4& InvM) { }
-    
-    virtual void UploadMVP(mat4& MVP) { }
-    
-    virtual void UploadVP(mat4& VP) { }
-    
-    virtual void UploadM(mat4& M) { }
-    
-    virtual void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) { }
-    
-    virtual void UploadLightAttributes(vec4 worldLightPosition, vec3 La, vec3 Le) { }
+    // draws the outline ShadowShader flattens onto the ground, by default
+    // the full detail; meshes with a low-poly shadow proxy draw that instead
+    virtual void DrawShadowInstanced(int nInstances) { DrawInstanced(0, nInstances); }
     
-    virtual void UploadEyePosition(vec3 wEye) { }
+    unsigned int GetVertexArray() { return vao; }
     
-    virtual void UploadSamplerID() { }
+    // 0 for geometry that cannot be culled
+    const BoundingVolume* GetBounds() { return bounds.radius >= 0 ? &bounds : 0; }
+
+    // geometries with simplified versions override these, level 0 is the full detail
+    virtual int GetLodCount() { return 1; }
+    virtual float GetLodError(int lod) { return 0; }
+};
+
+
+// single-pass OBJ reader: the whole file is read into one buffer and
+// tokenized in place, faces are kept as flat (position, texcoord, normal)
+// index triples so no allocation happens per line
+class ObjParser
+{
+    const char* p;
+    const char* end;
+
+    void SkipSpaces()
+    {
+        while(p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    }
+
+    void SkipLine()
+    {
+        while(p < end && *p != '\n') p++;
+        if(p < end) p++;
+    }
+
+    bool AtLineEnd()
+    {
+        SkipSpaces();
+        return p >= end || *p == '\n';
+    }
+
+    float ParseFloat();
+    int ParseInt();
+    bool ParseCorner(int* corner);
+
+public:
+    std::vector<vec3> positions;
+    std::vector<vec3> normals;
+    std::vector<vec2> texcoords;
+
+    // three 0-based indices (position, texcoord, normal) per triangle corner,
+    // -1 where the face omits the attribute
+    std::vector<int> corners;
+
+    int nTriangles;
+
+    ObjParser() : p(0), end(0), nTriangles(0) {}
+
+    bool Parse(const char* filename);
+
+    // turns the corners into an indexed triangle list, every distinct
+    // (position, texcoord, normal) triple becomes exactly one vertex
+    void BuildIndexed(std::vector<MeshVertex>& vertices, std::vector<unsigned int>& indices);
+};
+
+
+// number of post-transform cache misses, i.e. vertex shader invocations, when
+// drawing the index list through a FIFO cache of the given size
+template<typename Index>
+int CountVertexCacheMisses(const Index* indices, int nIndices, int cacheSize = 32)
+{
+    std::vector<int> cache(cacheSize, -1);
+    int head = 0;
+    int misses = 0;
+    for(int i = 0; i < nIndices; i++)
+    {
+        if(std::find(cache.begin(), cache.end(), (int)indices[i]) != cache.end()) continue;
+        cache[head] = indices[i];
+        head = (head + 1) % cacheSize;
+        misses++;
+    }
+    return misses;
+}
+
+
+// Forsyth's linear-speed vertex cache optimization: triangles are emitted
+// greedily by a score that favours vertices recently used (modelled as an
+// LRU cache) and vertices with few remaining triangles
+const int optimizerCacheSize = 32;
+
+float VertexCacheScore(int cachePosition, int remainingTriangles)
+{
+    if(remainingTriangles == 0) return -1.0f;
+
+    float score = 0.0f;
+    if(cachePosition >= 3) score = pow(1.0f - (cachePosition - 3) / (float)(optimizerCacheSize - 3), 1.5f);
+    else if(cachePosition >= 0) score = 0.75f;  // the last triangle's vertices score alike
+
+    return score + 2.0f / sqrt((float)remainingTriangles);
+}
+
+void OptimizeVertexCache(std::vector<unsigned int>& indices, int nVertices)
+{
+    int nTriangles = indices.size() / 3;
+    if(nTriangles == 0) return;
+
+    // vertex -> triangle adjacency, the first `remaining` entries of a vertex are its unemitted triangles
+    std::vector<int> remaining(nVertices, 0);
+    for(int i = 0; i < nTriangles * 3; i++) remaining[indices[i]]++;
+
+    std::vector<int> offsets(nVertices + 1, 0);
+    for(int v = 0; v < nVertices; v++) offsets[v + 1] = offsets[v] + remaining[v];
+
+    std::vector<int> adjacency(nTriangles * 3);
+    std::vector<int> filled(nVertices, 0);
+    for(int t = 0; t < nTriangles; t++)
+        for(int k = 0; k < 3; k++)
+        {
+            int v = indices[t * 3 + k];
+            adjacency[offsets[v] + filled[v]++] = t;
+        }
+
+    std::vector<int> cachePosition(nVertices, -1);
+    std::vector<float> vertexScore(nVertices);
+    for(int v = 0; v < nVertices; v++) vertexScore[v] = VertexCacheScore(-1, remaining[v]);
+
+    std::vector<bool> emitted(nTriangles, false);
+    int bestTriangle = 0;
+    float bestScore = -1.0f;
+    for(int t = 0; t < nTriangles; t++)
+    {
+        float score = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+        if(score > bestScore)
+        {
+            bestScore = score;
+            bestTriangle = t;
+        }
+    }
+
+    std::vector<int> cache;
+    std::vector<int> newCache;
+    cache.reserve(optimizerCacheSize + 3);
+    newCache.reserve(optimizerCacheSize + 3);
+
+    std::vector<unsigned int> result(indices.size());
+    int searchStart = 0;
+
+    for(int out = 0; out < nTriangles; out++)
+    {
+        if(bestTriangle < 0)
+        {
+            // nothing adjacent to the cache is left, continue with any unemitted triangle
+            while(emitted[searchStart]) searchStart++;
+            bestTriangle = searchStart;
+        }
+
+        int t = bestTriangle;
+        emitted[t] = true;
+
+        newCache.clear();
+        for(int k = 0; k < 3; k++)
+        {
+            int v = indices[t * 3 + k];
+            result[out * 3 + k] = v;
+            newCache.push_back(v);
+
+            int* triangles = &adjacency[offsets[v]];
+            for(int j = 0; j < remaining[v]; j++)
+                if(triangles[j] == t)
+                {
+                    triangles[j] = triangles[remaining[v] - 1];
+                    break;
+                }
+            remaining[v]--;
+        }
+        for(int i = 0; i < cache.size(); i++)
+            if(cache[i] != newCache[0] && cache[i] != newCache[1] && cache[i] != newCache[2])
+                newCache.push_back(cache[i]);
+        cache.swap(newCache);
+
+        // vertices that fell out of the cache lose their cache bonus
+        for(int i = optimizerCacheSize; i < cache.size(); i++)
+        {
+            cachePosition[cache[i]] = -1;
+            vertexScore[cache[i]] = VertexCacheScore(-1, remaining[cache[i]]);
+        }
+        if(cache.size() > optimizerCacheSize) cache.resize(optimizerCacheSize);
+
+        for(int i = 0; i < cache.size(); i++)
+        {
+            cachePosition[cache[i]] = i;
+            vertexScore[cache[i]] = VertexCacheScore(i, remaining[cache[i]]);
+        }
+
+        bestTriangle = -1;
+        bestScore = -1.0f;
+        for(int i = 0; i < cache.size(); i++)
+        {
+            int v = cache[i];
+            for(int j = 0; j < remaining[v]; j++)
+            {
+                int candidate = adjacency[offsets[v] + j];
+                float score = vertexScore[indices[candidate * 3]] + vertexScore[indices[candidate * 3 + 1]] + vertexScore[indices[candidate * 3 + 2]];
+                if(score > bestScore)
+                {
+                    bestScore = score;
+                    bestTriangle = candidate;
+                }
+            }
+        }
+    }
+
+    indices.swap(result);
+}
+
+// renumbers the vertices in the order the index list first uses them,
+// so vertex fetches walk through the buffer sequentially
+void OptimizeVertexFetch(std::vector<MeshVertex>& vertices, std::vector<unsigned int>& indices)
+{
+    std::vector<int> remap(vertices.size(), -1);
+    std::vector<MeshVertex> result;
+    result.reserve(vertices.size());
+
+    for(int i = 0; i < indices.size(); i++)
+    {
+        int& id = remap[indices[i]];
+        if(id < 0)
+        {
+            id = result.size();
+            result.push_back(vertices[indices[i]]);
+        }
+        indices[i] = id;
+    }
+
+    vertices.swap(result);
+}
+
+
+// symmetric 4x4 error quadric of Garland and Heckbert, the sum of squared
+// distances to a set of planes
+struct Quadric
+{
+    double a00, a01, a02, a03, a11, a12, a13, a22, a23, a33;
+    double weight;
+
+    Quadric() : a00(0), a01(0), a02(0), a03(0), a11(0), a12(0), a13(0), a22(0), a23(0), a33(0), weight(0) {}
+
+    // plane n.x + d = 0 with unit normal n, weighted by w
+    Quadric(const vec3& n, double d, double w)
+    {
+        a00 = w * n.x * n.x; a01 = w * n.x * n.y; a02 = w * n.x * n.z; a03 = w * n.x * d;
+        a11 = w * n.y * n.y; a12 = w * n.y * n.z; a13 = w * n.y * d;
+        a22 = w * n.z * n.z; a23 = w * n.z * d;
+        a33 = w * d * d;
+        weight = w;
+    }
+
+    void operator+=(const Quadric& q)
+    {
+        a00 += q.a00; a01 += q.a01; a02 += q.a02; a03 += q.a03;
+        a11 += q.a11; a12 += q.a12; a13 += q.a13;
+        a22 += q.a22; a23 += q.a23;
+        a33 += q.a33;
+        weight += q.weight;
+    }
+
+    // weighted sum of squared distances, Error / weight is their mean
+    double Error(const float* p) const
+    {
+        double x = p[0], y = p[1], z = p[2];
+        double e = a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x +
+                   a11 * y * y + 2 * a12 * y * z + 2 * a13 * y +
+                   a22 * z * z + 2 * a23 * z +
+                   a33;
+        return e > 0 ? e : 0;
+    }
+};
+
+vec3 TriangleNormal(const float* p0, const float* p1, const float* p2)
+{
+    vec3 e1(p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]);
+    vec3 e2(p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]);
+    return cross(e1, e2);
+}
+
+// quadric error edge collapse down to about targetIndexCount indices. Vertices
+// only collapse onto one of their neighbours, so the result indexes the
+// same vertex buffer. Vertices on open borders and on texture or normal seams
+// (positions shared by several vertices) are kept in place, so the
+// silhouette and the texture mapping do not tear; keepSeams false lets the
+// seams move for meshes whose texture and normals do not matter. Returns the object-space
+// error of the worst collapse as the root mean square distance to the
+// planes it merged
+float SimplifyMesh(const std::vector<MeshVertex>& vertices, const std::vector<unsigned int>& source, int targetIndexCount, std::vector<unsigned int>& indices,
+                   bool keepSeams = true)
+{
+    int nVertices = vertices.size();
+    indices = source;
+
+    std::vector<bool> seam(nVertices, false);
+    if(keepSeams)
+    {
+        std::unordered_map<std::string, int> firstWithPosition;
+        for(int v = 0; v < nVertices; v++)
+        {
+            std::string key((const char*)vertices[v].position, sizeof(vertices[v].position));
+            std::pair<std::unordered_map<std::string, int>::iterator, bool> inserted = firstWithPosition.insert(std::make_pair(key, v));
+            if(!inserted.second) seam[v] = seam[inserted.first->second] = true;
+        }
+    }
+
+    std::vector<Quadric> quadrics(nVertices);
+    for(int i = 0; i + 2 < indices.size(); i += 3)
+    {
+        const float* p0 = vertices[indices[i]].position;
+        vec3 n = TriangleNormal(p0, vertices[indices[i + 1]].position, vertices[indices[i + 2]].position);
+        double area = n.length();
+        if(area == 0) continue;
+        n = n / area;
+        Quadric q(n, -(n.x * p0[0] + n.y * p0[1] + n.z * p0[2]), area);
+        for(int k = 0; k < 3; k++) quadrics[indices[i + k]] += q;
+    }
+
+    struct Collapse
+    {
+        double cost;
+        int from, to;
+        bool operator<(const Collapse& c) const { return cost < c.cost; }
+    };
+
+    double maxError = 0;
+    std::vector<int> remap(nVertices);
+    std::vector<bool> locked(nVertices);
+    std::vector<int> offsets(nVertices + 1);
+    std::vector<int> adjacency;
+    std::vector<Collapse> collapses;
+
+    // every pass collapses a set of edges whose neighbourhoods do not overlap, so
+    // the adjacency built at the start of the pass stays valid throughout it
+    while(indices.size() > targetIndexCount)
+    {
+        int nTriangles = indices.size() / 3;
+
+        std::fill(offsets.begin(), offsets.end(), 0);
+        for(int i = 0; i < indices.size(); i++) offsets[indices[i] + 1]++;
+        for(int v = 0; v < nVertices; v++) offsets[v + 1] += offsets[v];
+        adjacency.resize(indices.size());
+        std::vector<int> filled(offsets.begin(), offsets.end() - 1);
+        for(int i = 0; i < indices.size(); i++) adjacency[filled[indices[i]]++] = i / 3;
+
+        // an edge of exactly one triangle is a border, of more than two non-manifold
+        std::unordered_map<unsigned long long, int> edgeUse;
+        edgeUse.reserve(indices.size());
+        for(int i = 0; i < indices.size(); i++)
+        {
+            unsigned long long a = indices[i], b = indices[i - i % 3 + (i + 1) % 3];
+            edgeUse[a < b ? (a << 32) | b : (b << 32) | a]++;
+        }
+        for(int v = 0; v < nVertices; v++) locked[v] = seam[v];
+        for(std::unordered_map<unsigned long long, int>::iterator e = edgeUse.begin(); e != edgeUse.end(); ++e)
+            if(e->second != 2) locked[e->first >> 32] = locked[e->first & 0xffffffff] = true;
+
+        collapses.clear();
+        for(int i = 0; i < indices.size(); i++)
+        {
+            int a = indices[i], b = indices[i - i % 3 + (i + 1) % 3];
+            for(int k = 0; k < 2; k++, std::swap(a, b))
+            {
+                if(locked[a]) continue;
+                Quadric q = quadrics[a];
+                q += quadrics[b];
+                Collapse c = { q.Error(vertices[b].position), a, b };
+                collapses.push_back(c);
+            }
+        }
+        std::sort(collapses.begin(), collapses.end());
+
+        for(int v = 0; v < nVertices; v++) remap[v] = v;
+        std::vector<bool> touched(nVertices, false);
+        int toRemove = (indices.size() - targetIndexCount) / 3;
+        int removed = 0;
+
+        for(int c = 0; c < collapses.size() && removed < toRemove; c++)
+        {
+            int from = collapses[c].from, to = collapses[c].to;
+            if(touched[from] || touched[to]) continue;
+
+            // reject collapses that flip a surviving triangle
+            bool flips = false;
+            int shared = 0;
+            for(int j = offsets[from]; j < offsets[from + 1] && !flips; j++)
+            {
+                const unsigned int* t = &indices[adjacency[j] * 3];
+                if(t[0] == to || t[1] == to || t[2] == to) { shared++; continue; }
+
+                const float* p[3];
+                const float* q[3];
+                for(int k = 0; k < 3; k++)
+                {
+                    p[k] = vertices[t[k]].position;
+                    q[k] = t[k] == from ? vertices[to].position : p[k];
+                }
+                vec3 before = TriangleNormal(p[0], p[1], p[2]);
+                vec3 after = TriangleNormal(q[0], q[1], q[2]);
+                flips = dot(before, after) <= 0;
+            }
+            if(flips) continue;
+
+            remap[from] = to;
+            removed += shared;
+            quadrics[to] += quadrics[from];
+            if(quadrics[to].weight > 0) maxError = std::max(maxError, collapses[c].cost / quadrics[to].weight);
+
+            for(int j = offsets[from]; j < offsets[from + 1]; j++)
+                for(int k = 0; k < 3; k++) touched[indices[adjacency[j] * 3 + k]] = true;
+        }
+
+        if(removed == 0) break;
+
+        std::vector<unsigned int> result;
+        result.reserve(indices.size());
+        for(int t = 0; t < nTriangles; t++)
+        {
+            unsigned int a = remap[indices[t * 3]], b = remap[indices[t * 3 + 1]], c = remap[indices[t * 3 + 2]];
+            if(a == b || b == c || c == a) continue;
+            result.push_back(a);
+            result.push_back(b);
+            result.push_back(c);
+        }
+        indices.swap(result);
+    }
+
+    return (float)sqrt(maxError);
+}
+
+
+// points every index at the first vertex with the same position, which
+// closes the texture and normal seams; triangles left without area are dropped
+void WeldPositions(const std::vector<MeshVertex>& vertices, const unsigned int* source, int nIndices, std::vector<unsigned int>& indices)
+{
+    std::vector<unsigned int> first(vertices.size());
+    std::unordered_map<std::string, unsigned int> firstWithPosition;
+    for(unsigned int v = 0; v < vertices.size(); v++)
+    {
+        std::string key((const char*)vertices[v].position, sizeof(vertices[v].position));
+        first[v] = firstWithPosition.insert(std::make_pair(key, v)).first->second;
+    }
+
+    indices.clear();
+    for(int i = 0; i + 2 < nIndices; i += 3)
+    {
+        unsigned int a = first[source[i]], b = first[source[i + 1]], c = first[source[i + 2]];
+        if(a == b || b == c || c == a) continue;
+        indices.push_back(a);
+        indices.push_back(b);
+        indices.push_back(c);
+    }
+}
+
+
+// level of detail of a PolygonalMesh, a range of its index buffer
+struct MeshLod
+{
+    unsigned int firstIndex;
+    unsigned int nIndices;
+    float error;  // object-space distance to the full detail surface
+};
+
+// what BuildMesh produces from an .obj and the mesh cache stores:
+// one vertex buffer shared by every level of detail, finest level first
+struct MeshData
+{
+    std::vector<MeshVertex> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<MeshLod> lods;
+    MeshLod shadowProxy;  // the range the planar shadow pass draws
+    unsigned long long sourceSize;  // size and modification time of the .obj
+    long long sourceTime;           // when parsing started
+};
+
+
+// binary image of a loaded mesh, written next to the .obj as <name>.obj.meshcache:
+// a MeshCacheHeader followed by the MeshLod table, the vertex blob and the index blob
+struct MeshCacheHeader
+{
+    char magic[4];
+    unsigned int version;
+    unsigned int vertexStride;
+    unsigned int nVertices;
+    unsigned int indexSize;
+    unsigned int nIndices;
+    unsigned int buildFlags;
+    unsigned int nLods;
+    MeshLod shadowProxy;
+    unsigned long long sourceSize;  // the .obj the cache was built from, which
+    long long sourceTime;           // must still have this size and mtime
+};
+
+const unsigned int meshCacheVersion = 6;
+
+// processing applied between parsing and caching, a cache built with other flags is rebuilt
+enum MESH_BUILD_FLAGS { OPTIMIZE_VERTEX_CACHE = 1, GENERATE_LODS = 2, GENERATE_SHADOW_PROXY = 4 };
+
+// --no-mesh-optimization clears OPTIMIZE_VERTEX_CACHE, --no-lods clears GENERATE_LODS,
+// --no-shadow-proxies clears GENERATE_SHADOW_PROXY
+unsigned int meshBuildFlags = OPTIMIZE_VERTEX_CACHE | GENERATE_LODS | GENERATE_SHADOW_PROXY;
+
+// each level of detail has about half the triangles of the previous one
+const int maxMeshLods = 4;
+const int minLodTriangles = 64;
+
+// triangles a shadow proxy is simplified to; meshes without a proxy, or
+// whose coarsest level of detail is already smaller, draw that level as shadow
+const int shadowProxyTriangles = 256;
+
+// screen-space error in pixels a level of detail may introduce, set with --lod-threshold
+float lodErrorThreshold = 1.0f;
+
+class MeshCache
+{
+    void* mapping;
+    size_t mappingSize;
+    std::vector<char> buffer;
+
+    void Close();
+
+public:
+    const MeshCacheHeader* header;
+    const MeshLod* lods;
+    const void* vertices;
+    const void* indices;
+
+    MeshCache() : mapping(0), mappingSize(0), header(0), lods(0), vertices(0), indices(0) {}
+    ~MeshCache() { Close(); }
+
+    static std::string PathFor(const char* filename) { return std::string(filename) + ".meshcache"; }
+
+    // maps the cache of the given .obj, fails if it is missing, older than
+    // the .obj, truncated or written by a different version
+    bool Open(const char* filename);
+
+    static bool Write(const char* filename, const MeshCacheHeader& header, const MeshLod* lods, const void* vertices, const void* indices);
+
+    // writes a built mesh, with 16-bit indices whenever the vertex count allows
+    static bool Write(const char* filename, const MeshData& mesh, unsigned int buildFlags);
+};
+
+
+class   PolygonalMesh : public Geometry
+{
+    int nTriangles;
+    int nIndices;
+    int indexSize;
+    unsigned int indexType;
+    std::vector<MeshLod> lods;
+    MeshLod shadowProxy;
+
+    void Upload(const MeshVertex* vertices, int nVertices, const void* indices, int nAllIndices);
+
+    // prints the vertex memory and vertex shader work saved by indexing
+    void Report(const char* filename, int nVertices, const void* indices);
+
+public:
+    PolygonalMesh(const char *filename, VERTEX_FORMAT format = FLOAT_VERTEX);
+
+    int GetLodCount() { return lods.size(); }
+    float GetLodError(int lod) { return lods[lod].error; }
+    void DrawInstanced(int lod, int nInstances);
+    void DrawShadowInstanced(int nInstances);
+};
+
+class TexturedQuad : public Geometry
+{
+public:
+    TexturedQuad(VERTEX_FORMAT format = FLOAT_VERTEX) : Geometry(format)
+    {
+        // triangle fan around the center, position / texture coordinates / normal
+        static MeshVertex vertices[] = {
+            { { 0,-1,0 },     { 0.5,0.5 },   { 0,1,0 } },
+            { { -1,-1,-1 },   { 0,0 },       { 0,1,0 } },
+            { { -1,-1,1 },    { 0,1 },       { 0,1,0 } },
+            { { 1,-1,1 },     { 1,1 },       { 0,1,0 } },
+            { { 1,-1,-1 },    { 1,0 },       { 0,1,0 } },
+            { { -1,-1,-1 },   { 0,0 },       { 0,1,0 } } };
+        UploadVertices(vertices, 6);
+    }
+    
+    void DrawInstanced(int lod, int nInstances)
+    {
+        glState.SetCapability(DEPTH_TEST_CAPABILITY, true);
+        glState.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glState.BindVertexArray(vao);
+        glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, 6, nInstances);
+    }
+};
+
+class InfiniteTexturedQuad : public Geometry
+{
+public:
+    InfiniteTexturedQuad(VERTEX_FORMAT format = FLOAT_VERTEX) : Geometry(format)
+    {
+        // triangle fan around the origin, the rim vertices are directions:
+        // InfiniteMeshShader gives them w = 0 so the quad reaches the horizon
+        static MeshVertex vertices[] = {
+            { { 0,0,0 },      { 0.5,0.5 },   { 0,1,0 } },
+            { { -1,0,-1 },    { 0,0 },       { 0,1,0 } },
+            { { -1,0,1 },     { 0,1 },       { 0,1,0 } },
+            { { 1,0,1 },      { 1,1 },       { 0,1,0 } },
+            { { 1,0,-1 },     { 1,0 },       { 0,1,0 } },
+            { { -1,0,-1 },    { 0,0 },       { 0,1,0 } } };
+        UploadVertices(vertices, 6);
+        bounds.radius = -1;
+    }
+    
+    void DrawInstanced(int lod, int nInstances)
+    {
+        glState.SetCapability(DEPTH_TEST_CAPABILITY, true);
+        glState.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glState.BindVertexArray(vao);
+        glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, 6, nInstances);
+    }
+};
+
+
+float ObjParser::ParseFloat()
+{
+    SkipSpaces();
+
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        p++;
+    }
+
+    // digits are accumulated into an integer mantissa and scaled once,
+    // which keeps the result as exact as strtof for the lengths OBJ uses
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    while(p < end && *p >= '0' && *p <= '9')
+    {
+        if(digits < 18) { mantissa = mantissa * 10 + (*p - '0'); digits++; }
+        else exponent++;
+        p++;
+    }
+    if(p < end && *p == '.')
+    {
+        p++;
+        while(p < end && *p >= '0' && *p <= '9')
+        {
+            if(digits < 18) { mantissa = mantissa * 10 + (*p - '0'); digits++; exponent--; }
+            p++;
+        }
+    }
+    if(p < end && (*p == 'e' || *p == 'E'))
+    {
+        p++;
+        exponent += ParseInt();
+    }
+
+    static const double powersOfTen[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+        1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+
+    double value = (double)mantissa;
+    if(exponent < 0)
+    {
+        if(exponent >= -18) value /= powersOfTen[-exponent];
+        else value *= pow(10.0, exponent);
+    }
+    else if(exponent > 0)
+    {
+        if(exponent <= 18) value *= powersOfTen[exponent];
+        else value *= pow(10.0, exponent);
+    }
+
+    return (float)(negative ? -value : value);
+}
+
+int ObjParser::ParseInt()
+{
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        p++;
+    }
+
+    int value = 0;
+    while(p < end && *p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+
+    return negative ? -value : value;
+}
+
+// reads one "v", "v/t", "v//n" or "v/t/n" face corner, resolving
+// 1-based and negative (relative) OBJ indices to 0-based ones
+bool ObjParser::ParseCorner(int* corner)
+{
+    if(AtLineEnd()) return false;
+
+    int counts[3] = { (int)positions.size(), (int)texcoords.size(), (int)normals.size() };
+
+    for(int k = 0; k < 3; k++)
+    {
+        corner[k] = -1;
+        if(k > 0)
+        {
+            if(p >= end || *p != '/') continue;
+            p++;
+        }
+        if(p < end && (*p == '-' || (*p >= '0' && *p <= '9')))
+        {
+            int index = ParseInt();
+            corner[k] = index < 0 ? counts[k] + index : index - 1;
+        }
+    }
+
+    while(p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+
+    return true;
+}
+
+bool ObjParser::Parse(const char* filename)
+{
+    FILE* file = fopen(filename, "rb");
+    if(!file)
+    {
+        printf("cannot open mesh %s\n", filename);
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    std::vector<char> buffer(size > 0 ? size : 1);
+    size_t read = fread(&buffer[0], 1, size, file);
+    fclose(file);
+
+    p = &buffer[0];
+    end = p + read;
+
+    // a rough guess of the element counts saves most of the regrowth
+    positions.reserve(read / 128);
+    normals.reserve(read / 128);
+    texcoords.reserve(read / 128);
+    corners.reserve(read / 8);
+
+    while(p < end)
+    {
+        SkipSpaces();
+        if(p >= end) break;
+
+        if(p[0] == 'v' && p + 1 < end && (p[1] == ' ' || p[1] == '\t'))
+        {
+            p++;
+            float x = ParseFloat();
+            float y = ParseFloat();
+            float z = ParseFloat();
+            positions.push_back(vec3(x, y, z));
+        }
+        else if(p[0] == 'v' && p + 1 < end && p[1] == 'n')
+        {
+            p += 2;
+            float x = ParseFloat();
+            float y = ParseFloat();
+            float z = ParseFloat();
+            normals.push_back(vec3(x, y, z));
+        }
+        else if(p[0] == 'v' && p + 1 < end && p[1] == 't')
+        {
+            p += 2;
+            float x = ParseFloat();
+            float y = ParseFloat();
+            texcoords.push_back(vec2(x, y));
+        }
+        else if(p[0] == 'f' && p + 1 < end && (p[1] == ' ' || p[1] == '\t'))
+        {
+            p++;
+
+            // quads are split along their 0-2 diagonal into (0,1,2) and (0,2,3)
+            int face[4][3];
+            int nCorners = 0;
+            while(nCorners < 4 && ParseCorner(face[nCorners])) nCorners++;
+
+            if(nCorners >= 3)
+            {
+                for(int k = 0; k < 3; k++) corners.insert(corners.end(), face[k], face[k] + 3);
+                nTriangles++;
+            }
+            if(nCorners == 4)
+            {
+                corners.insert(corners.end(), face[0], face[0] + 3);
+                corners.insert(corners.end(), face[2], face[2] + 3);
+                corners.insert(corners.end(), face[3], face[3] + 3);
+                nTriangles++;
+            }
+        }
+
+        SkipLine();
+    }
+
+    p = end = 0;
+    return true;
+}
+
+void ObjParser::BuildIndexed(std::vector<MeshVertex>& vertices, std::vector<unsigned int>& indices)
+{
+    int nCorners = nTriangles * 3;
+
+    vertices.clear();
+    indices.resize(nCorners);
+
+    // OBJ indices are far below 2^21, so the three of them pack into one 64-bit key
+    std::unordered_map<unsigned long long, unsigned int> vertexIds;
+    vertexIds.reserve(positions.size() * 2);
+    vertices.reserve(positions.size() * 2);
+
+    for(int i = 0; i < nCorners; i++)
+    {
+        const int* corner = &corners[i * 3];
+
+        unsigned long long key =
+            ((unsigned long long)(corner[0] + 1) << 42) |
+            ((unsigned long long)(corner[1] + 1) << 21) |
+            (unsigned long long)(corner[2] + 1);
+
+        std::pair<std::unordered_map<unsigned long long, unsigned int>::iterator, bool> inserted =
+            vertexIds.insert(std::make_pair(key, (unsigned int)vertices.size()));
+        indices[i] = inserted.first->second;
+        if(!inserted.second) continue;
+
+        vec3 position = corner[0] >= 0 && corner[0] < positions.size() ? positions[corner[0]] : vec3();
+        vec2 texcoord = corner[1] >= 0 && corner[1] < texcoords.size() ? texcoords[corner[1]] : vec2();
+        vec3 normal = corner[2] >= 0 && corner[2] < normals.size() ? normals[corner[2]] : vec3();
+
+        MeshVertex vertex;
+        vertex.position[0] = position.x;
+        vertex.position[1] = position.y;
+        vertex.position[2] = position.z;
+
+        vertex.texcoord[0] = texcoord.x;
+        vertex.texcoord[1] = 1-texcoord.y;
+
+        vertex.normal[0] = normal.x;
+        vertex.normal[1] = normal.y;
+        vertex.normal[2] = normal.z;
+
+        vertices.push_back(vertex);
+    }
+}
+
+
+void MeshCache::Close()
+{
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+    if(mapping) munmap(mapping, mappingSize);
+#endif
+    mapping = 0;
+    mappingSize = 0;
+    buffer.clear();
+    header = 0;
+    vertices = indices = 0;
+}
+
+bool MeshCache::Open(const char* filename)
+{
+    Close();
+
+    std::string path = PathFor(filename);
+
+    struct stat sourceStat, cacheStat;
+    if(stat(path.c_str(), &cacheStat) != 0) return false;
+    bool hasSource = stat(filename, &sourceStat) == 0;
+
+    size_t size = cacheStat.st_size;
+    if(size < sizeof(MeshCacheHeader)) return false;
+
+    const char* data;
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    mapping = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED)
+    {
+        mapping = 0;
+        return false;
+    }
+    mappingSize = size;
+    data = (const char*)mapping;
+#else
+    FILE* file = fopen(path.c_str(), "rb");
+    if(!file) return false;
+    buffer.resize(size);
+    size = fread(&buffer[0], 1, size, file);
+    fclose(file);
+    data = &buffer[0];
+#endif
+
+    const MeshCacheHeader* h = (const MeshCacheHeader*)data;
+    size_t lodBytes = (size_t)sizeof(MeshLod) * h->nLods;
+    size_t vertexBytes = (size_t)h->vertexStride * h->nVertices;
+    size_t indexBytes = (size_t)h->indexSize * h->nIndices;
+    // mtimes only have second resolution, comparing them with the cache's
+    // would take an .obj saved in the second the cache was written as older;
+    // a stamp that differs in any way means the .obj changed
+    bool stale = hasSource && size >= sizeof(MeshCacheHeader) &&
+        (h->sourceSize != (unsigned long long)sourceStat.st_size || h->sourceTime != (long long)sourceStat.st_mtime);
+    // the vertices are uploaded as MeshVertex and the indices read as 16 or
+    // 32 bits, so the layout the file claims has to be exactly that
+    bool layoutOk = h->vertexStride == sizeof(MeshVertex) && (h->indexSize == 2 || h->indexSize == 4);
+    if(memcmp(h->magic, "TCMC", 4) != 0 || h->version != meshCacheVersion || stale || !layoutOk ||
+       sizeof(MeshCacheHeader) + lodBytes + vertexBytes + indexBytes > size)
+    {
+        Close();
+        return false;
+    }
+
+    // the ranges are drawn straight from the element buffer, one that ends
+    // past it would have the draw read beyond it
+    const MeshLod* lodTable = (const MeshLod*)(data + sizeof(MeshCacheHeader));
+    bool rangesOk = h->nLods >= 1 &&
+        (unsigned long long)h->shadowProxy.firstIndex + h->shadowProxy.nIndices <= h->nIndices;
+    for(unsigned int i = 0; rangesOk && i < h->nLods; i++)
+        rangesOk = (unsigned long long)lodTable[i].firstIndex + lodTable[i].nIndices <= h->nIndices;
+    if(!rangesOk)
+    {
+        Close();
+        return false;
+    }
+
+    header = h;
+    lods = lodTable;
+    vertices = data + sizeof(MeshCacheHeader) + lodBytes;
+    indices = h->nIndices ? data + sizeof(MeshCacheHeader) + lodBytes + vertexBytes : 0;
+    return true;
+}
+
+bool MeshCache::Write(const char* filename, const MeshCacheHeader& header, const MeshLod* lods, const void* vertices, const void* indices)
+{
+    // written under a temporary name first so a crash never leaves a truncated cache behind
+    std::string path = PathFor(filename);
+    std::string tmpPath = path + ".tmp";
+
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if(!file) return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    if(ok && header.nLods)
+        ok = fwrite(lods, sizeof(MeshLod), header.nLods, file) == header.nLods;
+    if(ok && header.nVertices)
+        ok = fwrite(vertices, header.vertexStride, header.nVertices, file) == header.nVertices;
+    if(ok && header.nIndices)
+        ok = fwrite(indices, header.indexSize, header.nIndices, file) == header.nIndices;
+    ok = fclose(file) == 0 && ok;
+
+    if(ok) remove(path.c_str());
+    if(!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+bool MeshCache::Write(const char* filename, const MeshData& mesh, unsigned int buildFlags)
+{
+    MeshCacheHeader header = { { 'T', 'C', 'M', 'C' }, meshCacheVersion, sizeof(MeshVertex), (unsigned int)mesh.vertices.size(),
+                               4, (unsigned int)mesh.indices.size(), buildFlags, (unsigned int)mesh.lods.size(), mesh.shadowProxy,
+                               mesh.sourceSize, mesh.sourceTime };
+    if(mesh.vertices.size() > 65536) return Write(filename, header, mesh.lods.data(), mesh.vertices.data(), mesh.indices.data());
+
+    std::vector<unsigned short> shortIndices(mesh.indices.begin(), mesh.indices.end());
+    header.indexSize = 2;
+    return Write(filename, header, mesh.lods.data(), mesh.vertices.data(), shortIndices.data());
+}
+
+
+// parses the .obj into the indexed form stored in the mesh cache and applies
+// the processing selected by buildFlags, optionally printing what it gained
+bool BuildMesh(const char* filename, unsigned int buildFlags, MeshData& mesh, bool report)
+{
+    // stamped before parsing, an edit made meanwhile makes the cache stale
+    struct stat sourceStat;
+    if(stat(filename, &sourceStat) != 0) memset(&sourceStat, 0, sizeof(sourceStat));
+    mesh.sourceSize = sourceStat.st_size;
+    mesh.sourceTime = sourceStat.st_mtime;
+
+    ObjParser parser;
+    if(!parser.Parse(filename)) return false;
+
+    parser.BuildIndexed(mesh.vertices, mesh.indices);
+
+    MeshLod full = { 0, (unsigned int)mesh.indices.size(), 0.0f };
+    mesh.lods.assign(1, full);
+
+    if(buildFlags & GENERATE_LODS)
+    {
+        // every level is simplified from the previous one, so the errors add up
+        std::vector<unsigned int> previous = mesh.indices;
+        std::vector<unsigned int> simplified;
+        float error = 0;
+        while(mesh.lods.size() < maxMeshLods && previous.size() / 6 >= minLodTriangles)
+        {
+            error += SimplifyMesh(mesh.vertices, previous, previous.size() / 6 * 3, simplified);
+            if(simplified.size() > previous.size() * 9 / 10) break;
+
+            MeshLod lod = { (unsigned int)mesh.indices.size(), (unsigned int)simplified.size(), error };
+            mesh.lods.push_back(lod);
+            mesh.indices.insert(mesh.indices.end(), simplified.begin(), simplified.end());
+            previous.swap(simplified);
+        }
+
+        for(int i = 1; report && i < mesh.lods.size(); i++)
+            printf("%s: LOD %d, %d triangles, error %g\n", filename, i, mesh.lods[i].nIndices / 3, mesh.lods[i].error);
+    }
+
+    // the planar shadow is a flat silhouette, so the proxy is simplified from
+    // the full mesh with its seams welded, far below what a LOD may lose
+    mesh.shadowProxy = mesh.lods.back();
+    if((buildFlags & GENERATE_SHADOW_PROXY) && mesh.lods.back().nIndices / 3 > shadowProxyTriangles)
+    {
+        std::vector<unsigned int> welded, proxy;
+        WeldPositions(mesh.vertices, mesh.indices.data(), mesh.lods[0].nIndices, welded);
+        float error = SimplifyMesh(mesh.vertices, welded, shadowProxyTriangles * 3, proxy, false);
+
+        MeshLod shadowProxy = { (unsigned int)mesh.indices.size(), (unsigned int)proxy.size(), error };
+        mesh.shadowProxy = shadowProxy;
+        mesh.indices.insert(mesh.indices.end(), proxy.begin(), proxy.end());
+
+        if(report) printf("%s: shadow proxy, %d triangles, error %g\n", filename, shadowProxy.nIndices / 3, error);
+    }
+
+    if(buildFlags & OPTIMIZE_VERTEX_CACHE)
+    {
+        int nTriangles = mesh.lods[0].nIndices / 3;
+        int missesBefore = CountVertexCacheMisses(mesh.indices.data(), mesh.lods[0].nIndices);
+
+        std::vector<MeshLod> ranges = mesh.lods;
+        if(mesh.shadowProxy.firstIndex != mesh.lods.back().firstIndex) ranges.push_back(mesh.shadowProxy);
+
+        std::vector<unsigned int> lodIndices;
+        for(int i = 0; i < ranges.size(); i++)
+        {
+            std::vector<unsigned int>::iterator first = mesh.indices.begin() + ranges[i].firstIndex;
+            lodIndices.assign(first, first + ranges[i].nIndices);
+            OptimizeVertexCache(lodIndices, mesh.vertices.size());
+            std::copy(lodIndices.begin(), lodIndices.end(), first);
+        }
+        OptimizeVertexFetch(mesh.vertices, mesh.indices);
+
+        int missesAfter = CountVertexCacheMisses(mesh.indices.data(), mesh.lods[0].nIndices);
+        if(report && nTriangles > 0)
+            printf("%s: ACMR %.3f -> %.3f\n", filename, missesBefore / (float)nTriangles, missesAfter / (float)nTriangles);
+    }
+
+    return true;
+}
+
+
+PolygonalMesh::PolygonalMesh(const char *filename, VERTEX_FORMAT format) : Geometry(format)
+{
+    nTriangles = 0;
+    nIndices = 0;
+    indexSize = 4;
+    indexType = GL_UNSIGNED_INT;
+
+    MeshCache cache;
+    if(cache.Open(filename) && cache.header->vertexStride == sizeof(MeshVertex) &&
+       cache.header->buildFlags == meshBuildFlags && cache.indices && cache.lods)
+    {
+        lods.assign(cache.lods, cache.lods + cache.header->nLods);
+        shadowProxy = cache.header->shadowProxy;
+        nIndices = lods[0].nIndices;
+        nTriangles = nIndices / 3;
+        indexSize = cache.header->indexSize;
+        Upload((const MeshVertex*)cache.vertices, cache.header->nVertices, cache.indices, cache.header->nIndices);
+        Report(filename, cache.header->nVertices, cache.indices);
+        return;
+    }
+
+    MeshData mesh;
+    if(!BuildMesh(filename, meshBuildFlags, mesh, true))
+    {
+        MeshLod empty = { 0, 0, 0.0f };
+        lods.assign(1, empty);
+        shadowProxy = empty;
+        return;
+    }
+
+    lods = mesh.lods;
+    shadowProxy = mesh.shadowProxy;
+    nIndices = lods[0].nIndices;
+    nTriangles = nIndices / 3;
+
+    if(mesh.vertices.size() <= 65536)
+    {
+        std::vector<unsigned short> shortIndices(mesh.indices.begin(), mesh.indices.end());
+        indexSize = 2;
+        Upload(mesh.vertices.data(), mesh.vertices.size(), shortIndices.data(), mesh.indices.size());
+        Report(filename, mesh.vertices.size(), shortIndices.data());
+    }
+    else
+    {
+        Upload(mesh.vertices.data(), mesh.vertices.size(), mesh.indices.data(), mesh.indices.size());
+        Report(filename, mesh.vertices.size(), mesh.indices.data());
+    }
+
+    if(!MeshCache::Write(filename, mesh, meshBuildFlags))
+        printf("cannot write mesh cache for %s\n", filename);
+}
+
+void PolygonalMesh::Upload(const MeshVertex* vertices, int nVertices, const void* indices, int nAllIndices)
+{
+    indexType = indexSize == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
+    UploadVertices(vertices, nVertices);
+
+    // the element buffer binding is part of the VAO state
+    unsigned int ebo;
+    glGenBuffers(1, &ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, nAllIndices * indexSize, indices, GL_STATIC_DRAW);
+}
+
+void PolygonalMesh::Report(const char* filename, int nVertices, const void* indices)
+{
+    double unindexedKB = nIndices * VertexSize() / 1024.0;
+    double indexedKB = (nVertices * VertexSize() + nIndices * indexSize) / 1024.0;
+
+    int invocations = indexSize == 2 ?
+        CountVertexCacheMisses((const unsigned short*)indices, nIndices) :
+        CountVertexCacheMisses((const unsigned int*)indices, nIndices);
+
+    printf("%s: %d triangles, %d -> %d vertices (%d-byte vertices, %d-bit indices), %.1f -> %.1f KB, %d -> %d vertex shader invocations\n",
+           filename, nTriangles, nIndices, nVertices, VertexSize(), indexSize * 8, unindexedKB, indexedKB, nIndices, invocations);
+}
+
+
+void PolygonalMesh::DrawInstanced(int lod, int nInstances)
+{
+    glState.SetCapability(DEPTH_TEST_CAPABILITY, true);
+    glState.BindVertexArray(vao);
+    glDrawElementsInstanced(GL_TRIANGLES, lods[lod].nIndices, indexType, (void*)((size_t)lods[lod].firstIndex * indexSize), nInstances);
+}
+
+void PolygonalMesh::DrawShadowInstanced(int nInstances)
+{
+    glState.SetCapability(DEPTH_TEST_CAPABILITY, true);
+    glState.BindVertexArray(vao);
+    glDrawElementsInstanced(GL_TRIANGLES, shadowProxy.nIndices, indexType, (void*)((size_t)shadowProxy.firstIndex * indexSize), nInstances);
+}
+
+
+// instances one draw call can take, the object block array is sized by it
+// (64 * 208 bytes stays under the 16 KB every GL 3.2 driver allows a block)
+#define MAX_DRAW_INSTANCES 64
+#define GLSL_INT(x) #x
+#define GLSL_INT_VALUE(x) GLSL_INT(x)
+
+// uniform blocks shared by every shader, laid out as std140 with the
+// row-major matrices of mat4 so the C++ mirrors below upload as they are:
+// FrameBlock changes once per frame, ObjectBlock holds the objects of one
+// instanced draw, vertex shaders pick theirs by gl_InstanceID
+#define FRAME_BLOCK_GLSL " \n\
+        layout(std140, row_major) uniform FrameBlock { \n\
+            mat4 V, P, VP; \n\
+            vec4 worldEyePosition; \n\
+            vec4 worldLightPositions[2]; \n\
+            vec4 lightLa[2]; \n\
+            vec4 lightLe[2]; \n\
+            mat4 lightVP; \n\
+            vec4 shadowParams; \n\
+        }; \n\
+        "
+#define UNIFORM_BLOCKS_GLSL FRAME_BLOCK_GLSL " \n\
+        struct ObjectData { \n\
+            mat4 M, InvM, MVP; \n\
+            ivec4 lightIndex; \n\
+        }; \n\
+        layout(std140, row_major) uniform ObjectBlock { \n\
+            ObjectData objects[" GLSL_INT_VALUE(MAX_DRAW_INSTANCES) "]; \n\
+        }; \n\
+        "
+
+// how much of the sun reaches a point on the shadow map path, 1 when the map
+// is off or the point lies outside it; the comparison sampler blends the
+// results of the four nearest texels. Needs FRAME_BLOCK_GLSL
+#define SUN_VISIBILITY_GLSL " \n\
+        uniform sampler2DShadow shadowMap; \n\
+        float SunVisibility(vec4 shadowCoord) { \n\
+            if(shadowParams.x == 0.0 || shadowCoord.w <= 0.0) return 1.0; \n\
+            vec3 c = shadowCoord.xyz / shadowCoord.w * 0.5 + 0.5; \n\
+            if(c.x < 0.0 || c.x > 1.0 || c.y < 0.0 || c.y > 1.0 || c.z > 1.0) return 1.0; \n\
+            return texture(shadowMap, vec3(c.xy, c.z - shadowParams.y)); \n\
+        } \n\
+        "
+
+enum LIGHT_SLOT { SUN_LIGHT, SPOT_LIGHT, LIGHT_SLOT_COUNT };
+
+struct FrameUniformBlock
+{
+    mat4 V, P, VP;
+    float worldEyePosition[4];
+    float worldLightPositions[LIGHT_SLOT_COUNT][4];
+    float lightLa[LIGHT_SLOT_COUNT][4];
+    float lightLe[LIGHT_SLOT_COUNT][4];
+    mat4 lightVP;             // world to shadow map clip space
+    float shadowParams[4];    // shadow map on (1) or off (0), depth bias
+};
+
+struct ObjectUniformBlock
+{
+    mat4 M, InvM, MVP;
+    int lightIndex[4];
+};
+
+enum UNIFORM_BLOCK_BINDING { FRAME_BLOCK_BINDING, OBJECT_BLOCK_BINDING };
+
+// every uniform any of the shaders uploads outside the blocks, indexing Shader::uniforms
+enum UNIFORM_ID { KA_UNIFORM, KD_UNIFORM, KS_UNIFORM, SHININESS_UNIFORM, SAMPLER_UNIFORM,
+                  SHADOW_MAP_UNIFORM, UNIFORM_COUNT };
+
+const char* uniformNames[UNIFORM_COUNT] = { "ka", "kd", "ks", "shininess", "samplerUnit", "shadowMap" };
+
+// material textures are read from unit 0, the shadow map from this one
+const unsigned int shadowMapTextureUnit = 1;
+
+class Shader
+{
+protected:
+    unsigned int shaderProgram;
+    
+    // locations of the linked program, -1 for uniforms it does not have
+    int uniforms[UNIFORM_COUNT];
+    
+    // looks every uniform up once after linking; the ones the shader
+    // uploads but the program lacks are reported here instead of per draw
+    void ResolveUniforms(const char* name, const UNIFORM_ID* used, int nUsed)
+    {
+        for(int i = 0; i < UNIFORM_COUNT; i++) uniforms[i] = glGetUniformLocation(shaderProgram, uniformNames[i]);
+        
+        for(int i = 0; i < nUsed; i++)
+            if(uniforms[used[i]] < 0) printf("%s: uniform %s cannot be set\n", name, uniformNames[used[i]]);
+        
+        // the samplers always read the same texture units
+        glState.UseProgram(shaderProgram);
+        if(uniforms[SAMPLER_UNIFORM] >= 0) glUniform1i(uniforms[SAMPLER_UNIFORM], 0);
+        if(uniforms[SHADOW_MAP_UNIFORM] >= 0) glUniform1i(uniforms[SHADOW_MAP_UNIFORM], shadowMapTextureUnit);
+        
+        unsigned int frameBlock = glGetUniformBlockIndex(shaderProgram, "FrameBlock");
+        if(frameBlock != GL_INVALID_INDEX) glUniformBlockBinding(shaderProgram, frameBlock, FRAME_BLOCK_BINDING);
+        
+        unsigned int objectBlock = glGetUniformBlockIndex(shaderProgram, "ObjectBlock");
+        if(objectBlock != GL_INVALID_INDEX) glUniformBlockBinding(shaderProgram, objectBlock, OBJECT_BLOCK_BINDING);
+        else printf("%s: uniform block ObjectBlock cannot be bound\n", name);
+    }
+    
+public:
+    Shader()
+    {
+        shaderProgram = 0;
+        for(int i = 0; i < UNIFORM_COUNT; i++) uniforms[i] = -1;
+    }
+    
+    ~Shader()
+    {
+        if(shaderProgram) glState.DeleteProgram(shaderProgram);
+    }
+    
+    void Run()
+    {
+        if(shaderProgram) glState.UseProgram(shaderProgram);
+    }
+    
+    unsigned int GetProgram() { return shaderProgram; }
+    
+    virtual void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) { }
+    
+    virtual void UploadColor(vec3 colorRaw) { }
+};
+
+
+
+class MeshShader : public Shader
+{
+public:
+    MeshShader()
+    {
+        const char *vertexSource = "\n\
+        #version 150 \n\
+        precision highp float; \n\
+        " UNIFORM_BLOCKS_GLSL " \n\
+        in vec3 vertexPosition; \n\
+        in vec2 vertexTexCoord; \n\
+        in vec3 vertexNormal; \n\
+        out vec2 texCoord; \n\
+        out vec3 worldNormal; \n\
+        out vec3 worldView; \n\
+        out vec3 worldLight; \n\
+        out vec4 shadowCoord; \n\
+        flat out int lightSlot; \n\
+        \n\
+        void main() { \n\
+        mat4 M = objects[gl_InstanceID].M; \n\
+        mat4 InvM = objects[gl_InstanceID].InvM; \n\
+        mat4 MVP = objects[gl_InstanceID].MVP; \n\
+        lightSlot = objects[gl_InstanceID].lightIndex.x; \n\
+        vec4 worldLightPosition = worldLightPositions[lightSlot]; \n\
+        texCoord = vertexTexCoord; \n\
+        vec4 worldPosition = vec4(vertexPosition, 1) * M; \n\
+        worldLight  = worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w; \n\
+        worldView = worldEyePosition.xyz - worldPosition.xyz; \n\
+        worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz; \n\
+        shadowCoord = worldPosition * lightVP; \n\
+        gl_Position = vec4(vertexPosition, 1) * MVP; \n\
+        } \n\
+        ";
+        
+        const char *fragmentSource = "\n\
+        #version 150 \n\
+        precision highp float; \n\
+        " FRAME_BLOCK_GLSL SUN_VISIBILITY_GLSL " \n\
+        uniform sampler2D samplerUnit; \n\
+        uniform vec3 ka, kd, ks; \n\
+        uniform float shininess; \n\
+        in vec2 texCoord; \n\
+        in vec3 worldNormal; \n\
+        in vec3 worldView; \n\
+        in vec3 worldLight; \n\
+        in vec4 shadowCoord; \n\
+        flat in int lightSlot; \n\
+        out vec4 fragmentColor; \n\
+        \n\
+        void main() { \n\
+            vec3 La = lightLa[lightSlot].xyz; \n\
+            vec3 Le = lightLe[lightSlot].xyz; \n\
+            vec3 N = normalize(worldNormal); \n\
+            vec3 V = normalize(worldView); \n\
+            vec3 L = normalize(worldLight); \n\
+            vec3 H = normalize(V + L); \n\
+            vec3 texel = texture(samplerUnit, texCoord).xyz; \n\
+            float lit = lightSlot == 0 ? SunVisibility(shadowCoord) : 1.0; \n\
+            vec3 color = \n\
+                La * ka + \n\
+                lit * Le * kd * texel * max(0.0, dot(L, N)) + \n\
+                lit * Le * ks * pow(max(0.0, dot(H, N)), shininess); \n\
+            fragmentColor = vec4(color, 1); \n\
+        } \n\
+        ";
+        
+        unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
+        if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
+        
+        glShaderSource(vertexShader, 1, &vertexSource, NULL);
+        glCompileShader(vertexShader);
+        checkShader(vertexShader, "Vertex shader error");
+        
+        unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+        if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
+        
+        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+        glCompileShader(fragmentShader);
+        checkShader(fragmentShader, "Fragment shader error");
+        
+        shaderProgram = glCreateProgram();
+        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+        
+        glAttachShader(shaderProgram, vertexShader);
+        glAttachShader(shaderProgram, fragmentShader);
+        
+        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
+        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
+        glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+        
+        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+        
+        glLinkProgram(shaderProgram);
+        checkLinking(shaderProgram);
+        
+        ResolveMeshUniforms("MeshShader");
+    }
+    
+    void ResolveMeshUniforms(const char* name)
+    {
+        const UNIFORM_ID usedUniforms[] = { KA_UNIFORM, KD_UNIFORM, KS_UNIFORM, SHININESS_UNIFORM, SAMPLER_UNIFORM, SHADOW_MAP_UNIFORM };
+        ResolveUniforms(name, usedUniforms, sizeof(usedUniforms) / sizeof(usedUniforms[0]));
+    }
+    
+
+    void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) {
+        if (uniforms[KA_UNIFORM] >= 0) glUniform3fv(uniforms[KA_UNIFORM], 1, &ka.x);
+        if (uniforms[KD_UNIFORM] >= 0) glUniform3fv(uniforms[KD_UNIFORM], 1, &kd.x);
+        if (uniforms[KS_UNIFORM] >= 0) glUniform3fv(uniforms[KS_UNIFORM], 1, &ks.x);
+        if (uniforms[SHININESS_UNIFORM] >= 0) glUniform1f(uniforms[SHININESS_UNIFORM], shininess);
+    }
+};
+
+
+
+
+class InfiniteMeshShader : public MeshShader
+{
+public:
+    InfiniteMeshShader()
+    {
+        // shader program for rendering the ground as an infinite quad
+        
+        const char *vertexSource = "\n\
+        #version 150 \n\
+        precision highp float; \n\
+        " UNIFORM_BLOCKS_GLSL " \n\
+        in vec3 vertexPosition; \n\
+        in vec2 vertexTexCoord; \n\
+        in vec3 vertexNormal; \n\
+        \n\
+        out vec2 texCoord; \n\
+        out vec4 worldPosition; \n\
+        out vec3 worldNormal; \n\
+        flat out int lightSlot; \n\
+        \n\
+        void main() { \n\
+        mat4 M = objects[gl_InstanceID].M; \n\
+        mat4 InvM = objects[gl_InstanceID].InvM; \n\
+        mat4 MVP = objects[gl_InstanceID].MVP; \n\
+        lightSlot = objects[gl_InstanceID].lightIndex.x; \n\
+        float w = vertexPosition.x == 0.0 && vertexPosition.z == 0.0 ? 1.0 : 0.0; \n\
+        vec4 position = vec4(vertexPosition, w); \n\
+        texCoord = vertexTexCoord; \n\
+        worldPosition = position * M; \n\
+        worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz; \n\
+        gl_Position = position * MVP; \n\
+        } \n\
+        ";
+        
+        const char *fragmentSource = "\n\
+        #version 150 \n\
+        precision highp float; \n\
+        " FRAME_BLOCK_GLSL SUN_VISIBILITY_GLSL " \n\
+        uniform sampler2D samplerUnit; \n\
+        uniform vec3 ka, kd, ks; \n\
+        uniform float shininess; \n\
+        in vec2 texCoord; \n\
+        in vec4 worldPosition; \n\
+        in vec3 worldNormal; \n\
+        flat in int lightSlot; \n\
+        out vec4 fragmentColor; \n\
+        void main() { \n\
+        vec4 worldLightPosition = worldLightPositions[lightSlot]; \n\
+        vec3 La = lightLa[lightSlot].xyz; \n\
+        vec3 Le = lightLe[lightSlot].xyz; \n\
+        vec3 N = normalize(worldNormal); \n\
+        vec3 V = normalize(worldEyePosition.xyz * worldPosition.w - worldPosition.xyz);\n\
+        vec3 L = normalize(worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w);\n\
+        vec3 H = normalize(V + L); \n\
+        vec2 position = worldPosition.xz / worldPosition.w; \n\
+        vec2 tex = position.xy - floor(position.xy); \n\
+        vec3 texel = texture(samplerUnit, tex).xyz; \n\
+        float lit = lightSlot == 0 ? SunVisibility(worldPosition * lightVP) : 1.0; \n\
+        vec3 color = La * ka + lit * (Le * kd * texel* max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess)); \n\
+        fragmentColor = vec4(color, 1); \n\
+        } \n\
+        ";
+        
+        unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
+        if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
+        
+        glShaderSource(vertexShader, 1, &vertexSource, NULL);
+        glCompileShader(vertexShader);
+        checkShader(vertexShader, "Vertex shader error");
+        
+        unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+        if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
+        
+        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+        glCompileShader(fragmentShader);
+        checkShader(fragmentShader, "Fragment shader error");
+        
+        shaderProgram = glCreateProgram();
+        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+        
+        glAttachShader(shaderProgram, vertexShader);
+        glAttachShader(shaderProgram, fragmentShader);
+        
+        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
+        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
+        glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+        
+        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+        
+        glLinkProgram(shaderProgram);
+        checkLinking(shaderProgram);
+        
+        ResolveMeshUniforms("InfiniteMeshShader");
+    }
     
-    virtual void UploadColor(vec3 colorRaw) { }
 };
 
-
-
-class MeshShader : public Shader
+class ShadowShader : public Shader
 {
 public:
-    MeshShader()
+    ShadowShader()
     {
-        const char *vertexSource = "\n\
+        // shader program for rendering plane-projected shadows
+        
+        const char *vertexSource = " \n\
         #version 150 \n\
         precision highp float; \n\
-        \n\
+        " UNIFORM_BLOCKS_GLSL " \n\
         in vec3 vertexPosition; \n\
         in vec2 vertexTexCoord; \n\
         in vec3 vertexNormal; \n\
-        uniform mat4 M, InvM, MVP; \n\
-        uniform vec3 worldEyePosition; \n\
-        uniform vec4 worldLightPosition; \n\
-        out vec2 texCoord; \n\
-        out vec3 worldNormal; \n\
-        out vec3 worldView; \n\
-        out vec3 worldLight; \n\
         \n\
         void main() { \n\
-        texCoord = vertexTexCoord; \n\
-        vec4 worldPosition = vec4(vertexPosition, 1) * M; \n\
-        worldLight  = worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w; \n\
-        worldView = worldEyePosition - worldPosition.xyz; \n\
-        worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz; \n\
-        gl_Position = vec4(vertexPosition, 1) * MVP; \n\
+        vec4 worldLightPosition = worldLightPositions[0]; \n\
+        vec4 p = vec4(vertexPosition, 1) * objects[gl_InstanceID].M; \n\
+        vec3 s; \n\
+        s.y = -0.999; \n\
+        s.x = (p.x - worldLightPosition.x) / (p.y - worldLightPosition.y) * (s.y - worldLightPosition.y) + worldLightPosition.x; \n\
+        s.z = (p.z - worldLightPosition.z) / (p.y - worldLightPosition.y) * (s.y - worldLightPosition.y) + worldLightPosition.z; \n\
+        gl_Position = vec4(s, 1) * VP; \n\
         } \n\
         ";
         
-        const char *fragmentSource = "\n\
+        const char *fragmentSource = " \n\
         #version 150 \n\
         precision highp float; \n\
         \n\
-        uniform sampler2D samplerUnit; \n\
-        uniform vec3 La, Le; \n\
-        uniform vec3 ka, kd, ks; \n\
-        uniform float shininess; \n\
-        in vec2 texCoord; \n\
-        in vec3 worldNormal; \n\
-        in vec3 worldView; \n\
-        in vec3 worldLight; \n\
         out vec4 fragmentColor; \n\
         \n\
         void main() { \n\
-            vec3 N = normalize(worldNormal); \n\
-            vec3 V = normalize(worldView); \n\
-            vec3 L = normalize(worldLight); \n\
-            vec3 H = normalize(V + L); \n\
-            vec3 texel = texture(samplerUnit, texCoord).xyz; \n\
-            vec3 color = \n\
-                La * ka + \n\
-                Le * kd * texel * max(0.0, dot(L, N)) + \n\
-                Le * ks * pow(max(0.0, dot(H, N)), shininess); \n\
-            fragmentColor = vec4(color, 1); \n\
+        fragmentColor = vec4(0.0, 0.1, 0.0, 1); \n\
+        } \n\
+        ";
+        
+        unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
+        if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
+        
+        glShaderSource(vertexShader, 1, &vertexSource, NULL);
+        glCompileShader(vertexShader);
+        checkShader(vertexShader, "Vertex shader error");
+        
+        unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+        if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
+        
+        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+        glCompileShader(fragmentShader);
+        checkShader(fragmentShader, "Fragment shader error");
+        
+        shaderProgram = glCreateProgram();
+        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+        
+        glAttachShader(shaderProgram, vertexShader);
+        glAttachShader(shaderProgram, fragmentShader);
+        
+        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
+        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
+        glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+        
+        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+        
+        glLinkProgram(shaderProgram);
+        checkLinking(shaderProgram);
+        
+        ResolveUniforms("ShadowShader", 0, 0);
+    }
+};
+
+class ShadowMapShader : public Shader
+{
+public:
+    ShadowMapShader()
+    {
+        // shader program for rendering depth from the sun into the shadow map
+        
+        const char *vertexSource = " \n\
+        #version 150 \n\
+        precision highp float; \n\
+        " UNIFORM_BLOCKS_GLSL " \n\
+        in vec3 vertexPosition; \n\
+        in vec2 vertexTexCoord; \n\
+        in vec3 vertexNormal; \n\
+        \n\
+        void main() { \n\
+        gl_Position = vec4(vertexPosition, 1) * objects[gl_InstanceID].M * lightVP; \n\
+        } \n\
+        ";
+        
+        const char *fragmentSource = " \n\
+        #version 150 \n\
+        precision highp float; \n\
+        \n\
+        void main() { \n\
         } \n\
         ";
         
@@ -706,981 +2428,1582 @@ public:
         unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
         if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
         
-        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
-        glCompileShader(fragmentShader);
-        checkShader(fragmentShader, "Fragment shader error");
+        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+        glCompileShader(fragmentShader);
+        checkShader(fragmentShader, "Fragment shader error");
+        
+        shaderProgram = glCreateProgram();
+        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+        
+        glAttachShader(shaderProgram, vertexShader);
+        glAttachShader(shaderProgram, fragmentShader);
+        
+        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
+        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
+        glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+        
+        glLinkProgram(shaderProgram);
+        checkLinking(shaderProgram);
+        
+        ResolveUniforms("ShadowMapShader", 0, 0);
+    }
+};
+
+
+
+
+extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+
+class Texture
+{
+    unsigned int textureId;
+    
+public:
+    Texture(const std::string& inputFileName)
+    {
+        textureId = 0;
+        unsigned char* data;
+        int width; int height; int nComponents = 4;
+        
+        data = stbi_load(inputFileName.c_str(), &width, &height, &nComponents, 0);
+        
+        if(data == NULL)
+        {
+            return;
+        }
+        
+        glGenTextures(1, &textureId);
+        glState.BindTexture(0, textureId);
+        
+        if(nComponents == 3) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+        if(nComponents == 4) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        
+        delete data;
+    }
+    
+    unsigned int GetId() { return textureId; }
+    
+    void Bind(unsigned int unit)
+    {
+        glState.BindTexture(unit, textureId);
+    }
+};
+
+
+
+
+// the two uniform buffers every draw reads: the frame block is written once
+// per frame, the object blocks of a frame are gathered into one staging
+// array and sent with a single orphaning upload, each instanced draw then
+// binds the range holding its objects. (GL 4.1 on macOS has no persistent
+// mapping, orphaning gives the driver a fresh buffer without waiting on the
+// previous frame.)
+class UniformBuffers
+{
+    unsigned int frameBuffer;
+    unsigned int objectBuffer;
+    int objectAlignment;
+    int objectCapacity;
+    std::vector<char> objectStaging;
+    
+public:
+    static const int objectRangeSize = MAX_DRAW_INSTANCES * sizeof(ObjectUniformBlock);
+    
+    UniformBuffers() : frameBuffer(0), objectBuffer(0), objectAlignment(0), objectCapacity(0) {}
+    
+    ~UniformBuffers()
+    {
+        if(frameBuffer) glState.DeleteBuffer(frameBuffer);
+        if(objectBuffer) glState.DeleteBuffer(objectBuffer);
+    }
+    
+    void Initialize()
+    {
+        glGenBuffers(1, &frameBuffer);
+        glState.BindBuffer(UNIFORM_BUFFER_TARGET, frameBuffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniformBlock), NULL, GL_DYNAMIC_DRAW);
+        glState.BindUniformRange(FRAME_BLOCK_BINDING, frameBuffer, 0, sizeof(FrameUniformBlock));
+        
+        glGenBuffers(1, &objectBuffer);
+        
+        // ranges bound to a block must start at a multiple of this
+        objectAlignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &objectAlignment);
+        if(objectAlignment <= 0) objectAlignment = 256;
+    }
+    
+    void UploadFrame(const FrameUniformBlock& frame)
+    {
+        glState.BindBuffer(UNIFORM_BUFFER_TARGET, frameBuffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniformBlock), &frame);
+    }
+    
+    void BeginObjects() { objectStaging.clear(); }
+    
+    // appends the blocks of one draw (at most MAX_DRAW_INSTANCES), returns their offset
+    int PushObjects(const ObjectUniformBlock* blocks, int nBlocks)
+    {
+        int offset = ((int)objectStaging.size() + objectAlignment - 1) / objectAlignment * objectAlignment;
+        objectStaging.resize(offset + nBlocks * sizeof(ObjectUniformBlock));
+        memcpy(&objectStaging[offset], blocks, nBlocks * sizeof(ObjectUniformBlock));
+        return offset;
+    }
+    
+    void UploadObjects()
+    {
+        if(objectStaging.empty()) return;
+        
+        // a whole block array always fits behind the last offset, every
+        // bound range covers what the shaders declare
+        glState.BindBuffer(UNIFORM_BUFFER_TARGET, objectBuffer);
+        int size = (int)objectStaging.size();
+        if(size + objectRangeSize > objectCapacity) objectCapacity = size + objectRangeSize;
+        glBufferData(GL_UNIFORM_BUFFER, objectCapacity, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, size, &objectStaging[0]);
+    }
+    
+    void BindObjects(int offset)
+    {
+        glState.BindUniformRange(OBJECT_BLOCK_BINDING, objectBuffer, offset, objectRangeSize);
+    }
+};
+
+
+
+class Light
+{
+    vec3 La, Le;
+    vec4 worldLightPosition;
+    
+public:
+    Light(vec4 _worldLightPosition, vec3 _La = vec3(1,1,1), vec3 _Le = vec3(1,1,1)) {
+        worldLightPosition = _worldLightPosition;
+        La = _La;
+        Le = _Le;
+    }
+    
+    
+    void WriteUniforms(FrameUniformBlock& frame, int slot) {
+        for(int i = 0; i < 4; i++) frame.worldLightPositions[slot][i] = worldLightPosition.v[i];
+        frame.lightLa[slot][0] = La.x; frame.lightLa[slot][1] = La.y; frame.lightLa[slot][2] = La.z; frame.lightLa[slot][3] = 0;
+        frame.lightLe[slot][0] = Le.x; frame.lightLe[slot][1] = Le.y; frame.lightLe[slot][2] = Le.z; frame.lightLe[slot][3] = 0;
+    }
+          
+          
+    vec4 GetWorldPosition() { return worldLightPosition; }
+    
+    void SetPointLightSource(vec3& pos) {
+        worldLightPosition = vec4(pos.x,pos.y, pos.z, 1);
+    }
+    
+    void SetDirectionalLightSource(vec3& dir) {
+        worldLightPosition = vec4(dir.x,dir.y, dir.z, 0);
+    }
+};
+
+// the sun lights and shadows the scene, the spotlight follows the avatar
+Light lights[LIGHT_SLOT_COUNT] = { Light(vec4(0,400,200,0)), Light(vec4(0,2,2,1)) };
+
+// how the sun's shadows are drawn: flattened copies of the casters on the
+// ground plane, or a depth map of the casters seen from the sun that the
+// mesh shaders sample, so cars shadow each other (--shadow-map)
+enum SHADOW_MODE { PLANAR_SHADOWS, SHADOW_MAP };
+
+SHADOW_MODE shadowMode = PLANAR_SHADOWS;
+
+// texels per side of the shadow map, set with --shadow-map-size
+int shadowMapSize = 2048;
+
+// depth map of the casters as the sun sees them: an orthographic view of a
+// box of shadowMapRadius around a point ahead of the camera, rendered into a
+// depth texture that is then sampled with comparison on shadowMapTextureUnit
+class ShadowMap
+{
+    unsigned int fbo;
+    unsigned int depthTexture;
+    int size;
+    
+    unsigned int savedFramebuffer;
+    int savedViewport[4];
+    
+public:
+    static constexpr float radius = 10.0f;
+    
+    ShadowMap() : fbo(0), depthTexture(0), size(0), savedFramebuffer(0) {}
+    
+    ~ShadowMap()
+    {
+        if(fbo) glDeleteFramebuffers(1, &fbo);
+        if(depthTexture) glDeleteTextures(1, &depthTexture);
+    }
+    
+    // creates the map on first use, so planar runs never allocate it
+    bool Initialize()
+    {
+        if(fbo) return true;
+        size = shadowMapSize;
+        
+        glGenTextures(1, &depthTexture);
+        glState.BindTexture(shadowMapTextureUnit, depthTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        
+        unsigned int previous = glState.GetFramebuffer();
+        glGenFramebuffers(1, &fbo);
+        glState.BindFramebuffer(fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        glState.BindFramebuffer(previous);
+        
+        // pushes the stored depths back along the slopes, against shadow acne
+        glPolygonOffset(2.0f, 4.0f);
+        
+        if(!complete)
+        {
+            printf("cannot create the %dx%d shadow map, falling back to planar shadows\n", size, size);
+            shadowMode = PLANAR_SHADOWS;
+        }
+        return complete;
+    }
+    
+    // the sun's view of the box around center; the box moves in whole texels
+    // so the shadow edges do not shimmer while the camera moves
+    void WriteUniforms(FrameUniformBlock& frame, vec4 sunPosition, vec3 center)
+    {
+        if(shadowMode != SHADOW_MAP)
+        {
+            memset(frame.lightVP.m, 0, sizeof(frame.lightVP.m));
+            memset(frame.shadowParams, 0, sizeof(frame.shadowParams));
+            return;
+        }
+        
+        vec3 w = vec3(sunPosition.v[0], sunPosition.v[1], sunPosition.v[2]).normalize();
+        vec3 up = fabs(w.y) > 0.99f ? vec3(1, 0, 0) : vec3(0, 1, 0);
+        vec3 u = cross(up, w).normalize();
+        vec3 v = cross(w, u);
         
-        shaderProgram = glCreateProgram();
-        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+        float texel = 2 * radius / shadowMapSize;
+        float cu = dot(center, u), cv = dot(center, v);
+        center = center + u * (floor(cu / texel) * texel - cu) + v * (floor(cv / texel) * texel - cv);
         
-        glAttachShader(shaderProgram, vertexShader);
-        glAttachShader(shaderProgram, fragmentShader);
+        mat4 view =
+        mat4(
+             1.0f,      0.0f,      0.0f,      0.0f,
+             0.0f,      1.0f,      0.0f,      0.0f,
+             0.0f,      0.0f,      1.0f,      0.0f,
+             -center.x, -center.y, -center.z, 1.0f ) *
+        mat4(
+             u.x,  v.x,  w.x,  0.0f,
+             u.y,  v.y,  w.y,  0.0f,
+             u.z,  v.z,  w.z,  0.0f,
+             0.0f, 0.0f, 0.0f, 1.0f );
         
-        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
-        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
-        glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+        // depths from 2 radii towards the sun to 2 radii away from it
+        mat4 projection(
+             1 / radius, 0.0f,       0.0f,                0.0f,
+             0.0f,       1 / radius, 0.0f,                0.0f,
+             0.0f,       0.0f,       -1 / (2 * radius),   0.0f,
+             0.0f,       0.0f,       0.0f,                1.0f);
         
-        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+        frame.lightVP = view * projection;
+        frame.shadowParams[0] = 1;
+        frame.shadowParams[1] = 0.0005f;
+        frame.shadowParams[2] = frame.shadowParams[3] = 0;
+    }
+    
+    // redirects drawing into the map until End
+    void Begin()
+    {
+        savedFramebuffer = glState.GetFramebuffer();
+        glState.GetViewport(savedViewport);
         
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
+        // the map must not be sampled while it is being written
+        glState.BindTexture(shadowMapTextureUnit, 0);
+        glState.BindFramebuffer(fbo);
+        glState.Viewport(0, 0, size, size);
+        glState.DepthMask(true);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        glState.SetCapability(POLYGON_OFFSET_FILL_CAPABILITY, true);
+    }
+    
+    void End()
+    {
+        glState.SetCapability(POLYGON_OFFSET_FILL_CAPABILITY, false);
+        glState.BindFramebuffer(savedFramebuffer);
+        glState.Viewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+        glState.BindTexture(shadowMapTextureUnit, depthTexture);
+    }
+};
+
+class Material
+{
+    Shader* shader;
+    Texture* texture;
+    vec3 ka, kd, ks;
+    float shininess;
+    
+public:
+    Material(Shader* s, vec3 _ka, vec3 _kd, vec3 _ks, float _shininess, Texture* t = 0)
+    {
+        shader = s;
+        ka = _ka;
+        kd = _kd;
+        ks = _ks;
+        shininess = _shininess;
+        texture = t;
     }
     
-    void UploadSamplerID()
+    Shader* GetShader() { return shader; }
+    
+    Texture* GetTexture() { return texture; }
+    
+    void UploadAttributes()
+    {
+        // the samplers read texture unit 0
+        if(texture) texture->Bind(0);
+        shader->UploadMaterialAttributes(ka, kd, ks, shininess);
+    }
+};
+
+
+
+
+
+class Mesh
+{
+    Geometry* geometry;
+    Material* material;
+    
+public:
+    Mesh(Geometry* g, Material* m)
     {
-        int samplerUnit = 0;
-        int location = glGetUniformLocation(shaderProgram, "samplerUnit");
-        glUniform1i(location, samplerUnit);
-        glActiveTexture(GL_TEXTURE0 + samplerUnit);
+        geometry = g;
+        material = m;
     }
     
+    Shader* GetShader() { return material->GetShader(); }
+    
+    Material* GetMaterial() { return material; }
+    
+    Geometry* GetGeometry() { return geometry; }
+    
+    void Draw(int lod = 0, int nInstances = 1)
+    {
+        material->UploadAttributes();
+        geometry->DrawInstanced(lod, nInstances);
+    }
+};
+
+
+
 
-    void UploadInvM(mat4& InvM)
+
+class Camera {
+    vec3  wEye, wLookat, wVup, velocity;
+    vec3  previousEye, previousLookat;
+    float fov, asp, fp, bp, speed, angularVelocity;
+    float screenHeight;
+    
+public:
+    Camera()
     {
-        int location = glGetUniformLocation(shaderProgram, "InvM");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, InvM);
-        else printf("uniform InvM cannot be set\n");
+        wEye = vec3(1.0, 0.0, 3.0);
+        wLookat = vec3(0.5, 0.0, 0.0);
+        wVup = vec3(0.0, 1.0, 0.0);
+        velocity = vec3(0.0,0.0,0.0);
+        angularVelocity =0;
+        fov = M_PI / 4.0; asp = 1.0; fp = 0.01; bp = 20.0;
+        screenHeight = windowHeight;
+        previousEye = wEye;
+        previousLookat = wLookat;
+    }
+    
+    vec3 getEyePosition() {
+        return wEye;
     }
     
-    void UploadMVP(mat4& MVP)
+    void SetAspectRatio(float a) { asp = a; }
+    
+    void SetScreenHeight(float h) { screenHeight = h; }
+    
+    // distance of a point from the eye, 0 at the eye and 1 at the far plane
+    float GetDepth(vec3 worldPosition)
     {
-        int location = glGetUniformLocation(shaderProgram, "MVP");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVP);
-        else printf("uniform MVP cannot be set\n");
+        return (worldPosition - wEye).length() / bp;
     }
     
-    void UploadM(mat4& M)
+    // height in pixels of a world-space length seen at the given point
+    float GetProjectedSize(float worldSize, vec3 worldPosition)
     {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
+        float distance = (worldPosition - wEye).length();
+        if(distance <= fp) return worldSize > 0 ? 1e30f : 0;
+        return worldSize / distance * screenHeight / (2 * tan(fov / 2));
     }
     
-    void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) {
-        int location = glGetUniformLocation(shaderProgram, "ka");
-        if (location >= 0) glUniform3fv(location, 1, &ka.x);
-        else printf("uniform ka cannot be set\n");
+    // the view at the start and the end of the tick, for handing the
+    // simulated camera over to rendering
+    void GetView(vec3& eye, vec3& lookat, vec3& _previousEye, vec3& _previousLookat) {
+        eye = wEye;
+        lookat = wLookat;
+        _previousEye = previousEye;
+        _previousLookat = previousLookat;
+    }
+    
+    void SetView(vec3 eye, vec3 lookat, vec3 _previousEye, vec3 _previousLookat) {
+        wEye = eye;
+        wLookat = lookat;
+        previousEye = _previousEye;
+        previousLookat = _previousLookat;
+    }
+    
+    // remembers the state at the start of a tick for interpolation
+    void BeginTick() {
+        previousEye = wEye;
+        previousLookat = wLookat;
+    }
+    
+    void Move(float dt) {
+        wEye = wEye + velocity*dt;
+        wLookat = wLookat +velocity*dt;
         
-        location = glGetUniformLocation(shaderProgram, "kd");
-        if (location >= 0) glUniform3fv(location, 1, &kd.x);
-        else printf("uniform kd cannot be set\n");
+        vec3 r = cross(GetAhead(), wVup.normalize());
+        float d = wLookat.length();
+        if(d != 0) { wLookat = wLookat.normalize(); }
+        float angle = angularVelocity*dt;
+        wLookat = (wLookat*cos(angle) + r*sin(angle))*d;
+    }
+    
+    void Control(float dt, const InputState& input) {
+        if(input.keys['d']) {
+            angularVelocity = 2.0;
+        }
+        else if(input.keys['a']) {
+            angularVelocity = -2.0;
+        }
+        else {
+            angularVelocity = 0;
+        }
         
-        location = glGetUniformLocation(shaderProgram, "ks");
-        if (location >= 0) glUniform3fv(location, 1, &ks.x);
-        else printf("uniform ks cannot be set\n");
+        if(input.keys['w']) {
+            velocity = GetAhead() * 1.5;
+        }
+        else if(input.keys['s']) {
+            velocity = GetAhead() * -1.5;
+        }
+//        else if(input.arrowKeys[0]) {
+//            velocity.x = -2.0*dt;
+//        }
+//        else if(input.arrowKeys[2]) {
+//            velocity.x = 2.0*dt;
+//        }
+//        else if(input.arrowKeys[1]) {
+//            velocity.z = -2.0*dt;
+//        }
+//        else if(input.arrowKeys[3]) {
+//            velocity.z = 2.0*dt;
+//        }
+        else {
+            velocity = vec3(0.0,0.0,0.0);
+        }
         
-        location = glGetUniformLocation(shaderProgram, "shininess");
-        if (location >= 0) glUniform1f(location, shininess);
-        else printf("uniform shininess cannot be set\n");
+        if(input.keys['T'] || input.keys['t']) {
+            double theta = trackingT;
+            // derivative of the heart curve
+            velocity.x = 48*cos(theta)*pow(sin(theta), 2)/10.0;
+            velocity.z = -1*(-13*sin(theta)+10*sin(2*theta)+6*sin(3*theta)+4*sin(4*theta))/10.0;
+            trackingT += dt;
+        }
     }
     
-    void UploadLightAttributes(vec4 worldLightPosition, vec3 La, vec3 Le) {
-        int location = glGetUniformLocation(shaderProgram, "worldLightPosition");
-        if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
-        else printf("uniform worldLightPosition cannot be set\n");
-        
-        location = glGetUniformLocation(shaderProgram, "La");
-        if (location >= 0) glUniform3fv(location, 1, &La.x);
-        else printf("uniform La cannot be set\n");
+    // alpha is how far rendering is between the previous tick and this one
+    void WriteUniforms(FrameUniformBlock& frame, float alpha) {
+        frame.V = GetViewMatrix(previousEye + (wEye - previousEye) * alpha, previousLookat + (wLookat - previousLookat) * alpha);
+        frame.P = GetProjectionMatrix();
+        frame.VP = frame.V * frame.P;
+        frame.worldEyePosition[0] = wEye.x;
+        frame.worldEyePosition[1] = wEye.y;
+        frame.worldEyePosition[2] = wEye.z;
+        frame.worldEyePosition[3] = 1;
+    }
+    
+    vec3 GetAhead() {
+        return (wLookat-wEye).normalize();
+    }
+    
+    mat4 GetViewMatrix(vec3 wEye, vec3 wLookat)
+    {
+        vec3 w = (wEye - wLookat).normalize();
+        vec3 u = cross(wVup, w).normalize();
+        vec3 v = cross(w, u);
         
-        location = glGetUniformLocation(shaderProgram, "Le");
-        if (location >= 0) glUniform3fv(location, 1, &Le.x);
-        else printf("uniform Le cannot be set\n");
+        return
+        mat4(
+             1.0f,    0.0f,    0.0f,    0.0f,
+             0.0f,    1.0f,    0.0f,    0.0f,
+             0.0f,    0.0f,    1.0f,    0.0f,
+             -wEye.x, -wEye.y, -wEye.z, 1.0f ) *
+        mat4(
+             u.x,  v.x,  w.x,  0.0f,
+             u.y,  v.y,  w.y,  0.0f,
+             u.z,  v.z,  w.z,  0.0f,
+             0.0f, 0.0f, 0.0f, 1.0f );
     }
     
-    void UploadEyePosition(vec3 wEye) {
-        int location = glGetUniformLocation(shaderProgram, "worldEyePosition");
-        if (location >= 0) glUniform3fv(location, 1, &wEye.x);
-        else printf("uniform worldEyePosition cannot be set\n");
+    mat4 GetProjectionMatrix()
+    {
+        float sy = 1/tan(fov/2);
+        return mat4(
+                    sy/asp, 0.0f,  0.0f,               0.0f,
+                    0.0f,   sy,    0.0f,               0.0f,
+                    0.0f,   0.0f, -(fp+bp)/(bp - fp), -1.0f,
+                    0.0f,   0.0f, -2*fp*bp/(bp - fp),  0.0f);
     }
 };
 
+// camera draws with the view of the latest snapshot and the window's
+// projection, simulationCamera is the one the keys move
+Camera camera;
+Camera simulationCamera;
 
 
 
-class InfiniteMeshShader : public MeshShader
+
+
+// integration kernels of the tick, 4 floats at a time over the x, y, z
+// floats of vec3 arrays laid end to end, with the same per-element
+// arithmetic as the scalar loops they replace
+
+// a[i] += b[i] * scale; the product is a statement of its own in the tail
+// so it is never fused into a multiply-add the 4-wide path does not do
+void AddScaledArrays(float* a, const float* b, float scale, int n)
+{
+    float4 s = Splat4(scale);
+    int i = 0;
+    for(; i + 4 <= n; i += 4) StoreUnaligned4(a + i, Add4(LoadUnaligned4(a + i), Mul4(LoadUnaligned4(b + i), s)));
+    for(; i < n; i++) {
+        float step = b[i] * scale;
+        a[i] += step;
+    }
+}
+
+// angles[i] += rates[i] * scale in degrees, then whole turns at or above 360
+// are taken off without a branch; angles below 0 are left alone as they always were
+void TurnAngles(float* angles, const float* rates, float scale, int n)
+{
+    float4 fullTurn = Splat4(360), zero = Splat4(0), s = Splat4(scale);
+    int i = 0;
+    for(; i + 4 <= n; i += 4) {
+        float4 angle = Add4(LoadUnaligned4(angles + i), Mul4(LoadUnaligned4(rates + i), s));
+        float4 turns = Max4(Truncate4(Div4(angle, fullTurn)), zero);
+        StoreUnaligned4(angles + i, Sub4(angle, Mul4(turns, fullTurn)));
+    }
+    for(; i < n; i++) {
+        float step = rates[i] * scale;
+        float angle = angles[i] + step;
+        angles[i] = angle - std::max(0.0f, truncf(angle / 360)) * 360;
+    }
+}
+
+// simulation state of every object in the scene, one dense array per field
+// (structure of arrays), so the tick is a few straight loops over contiguous
+// memory instead of a virtual-free but pointer-chasing walk over objects.
+// Entity i is the scene's object i; the Object keeps only what rendering
+// needs (mesh, hierarchy, cached matrices) and reads the rest from here
+class Entities
 {
 public:
-    InfiniteMeshShader()
+    std::vector<vec3> position, velocity, acceleration;
+    std::vector<vec3> orientation, rotationRate;
+    
+    // state at the start of the current tick, rendering interpolates from it
+    std::vector<vec3> previousPosition, previousOrientation;
+    
+    std::vector<unsigned char> type;
+    std::vector<unsigned char> avatar;
+    std::vector<unsigned char> canJump;
+    
+    // a random stream per entity, sequence i of the scene seed, so what an
+    // entity draws does not depend on which thread updates it or when
+    std::vector<Random> random;
+    unsigned long long seed;
+    
+    Entities() : seed(1) {}
+    
+    int Size() const { return (int)position.size(); }
+    
+    void Seed(unsigned long long _seed)
     {
-        // shader program for rendering the ground as an infinite quad
-        
-        const char *vertexSource = "\n\
-        #version 150 \n\
-        precision highp float; \n\
-        \n\
-        in vec4 vertexPosition; \n\
-        in vec2 vertexTexCoord; \n\
-        in vec3 vertexNormal; \n\
-        uniform mat4 M, InvM, MVP; \n\
-        \n\
-        out vec2 texCoord; \n\
-        out vec4 worldPosition; \n\
-        out vec3 worldNormal; \n\
-        \n\
-        void main() { \n\
-        texCoord = vertexTexCoord; \n\
-        worldPosition = vertexPosition * M; \n\
-        worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz; \n\
-        gl_Position = vertexPosition * MVP; \n\
-        } \n\
-        ";
-        
-        const char *fragmentSource = "\n\
-        #version 150 \n\
-        precision highp float; \n\
-        uniform sampler2D samplerUnit; \n\
-        uniform vec3 La, Le; \n\
-        uniform vec3 ka, kd, ks; \n\
-        uniform float shininess; \n\
-        uniform vec3 worldEyePosition; \n\
-        uniform vec4 worldLightPosition; \n\
-        in vec2 texCoord; \n\
-        in vec4 worldPosition; \n\
-        in vec3 worldNormal; \n\
-        out vec4 fragmentColor; \n\
-        void main() { \n\
-        vec3 N = normalize(worldNormal); \n\
-        vec3 V = normalize(worldEyePosition * worldPosition.w - worldPosition.xyz);\n\
-        vec3 L = normalize(worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w);\n\
-        vec3 H = normalize(V + L); \n\
-        vec2 position = worldPosition.xz / worldPosition.w; \n\
-        vec2 tex = position.xy - floor(position.xy); \n\
-        vec3 texel = texture(samplerUnit, tex).xyz; \n\
-        vec3 color = La * ka + Le * kd * texel* max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess); \n\
-        fragmentColor = vec4(color, 1); \n\
-        } \n\
-        ";
-        
-        unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
-        
-        glShaderSource(vertexShader, 1, &vertexSource, NULL);
-        glCompileShader(vertexShader);
-        checkShader(vertexShader, "Vertex shader error");
-        
-        unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-        if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
-        
-        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
-        glCompileShader(fragmentShader);
-        checkShader(fragmentShader, "Fragment shader error");
-        
-        shaderProgram = glCreateProgram();
-        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
-        
-        glAttachShader(shaderProgram, vertexShader);
-        glAttachShader(shaderProgram, fragmentShader);
-        
-        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
-        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
-        glBindAttribLocation(shaderProgram, 2, "vertexNormal");
-        
-        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
-        
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
+        seed = _seed;
+        for(int i = 0; i < Size(); i++) random[i].Seed(seed, i);
+    }
+    
+    int Add(vec3 _position, vec3 _orientation, vec3 _rotationRate, vec3 _acceleration, OBJECT_TYPE _type, bool isAvatar)
+    {
+        position.push_back(_position);
+        velocity.push_back(vec3());
+        acceleration.push_back(_acceleration);
+        orientation.push_back(_orientation);
+        rotationRate.push_back(_rotationRate);
+        previousPosition.push_back(_position);
+        previousOrientation.push_back(_orientation);
+        type.push_back(_type);
+        avatar.push_back(isAvatar);
+        canJump.push_back(false);
+        random.push_back(Random());
+        random.back().Seed(seed, Size() - 1);
+        return Size() - 1;
     }
     
-};
-
-class ShadowShader : public Shader
-{
-public:
-    ShadowShader()
+    void Clear()
     {
-        // shader program for rendering plane-projected shadows
-        
-        const char *vertexSource = " \n\
-        #version 150 \n\
-        precision highp float; \n\
-        \n\
-        in vec3 vertexPosition; \n\
-        in vec2 vertexTexCoord; \n\
-        in vec3 vertexNormal; \n\
-        uniform mat4 M, VP; \n\
-        uniform vec4 worldLightPosition; \n\
-        \n\
-        void main() { \n\
-        vec4 p = vec4(vertexPosition, 1) * M; \n\
-        vec3 s; \n\
-        s.y = -0.999; \n\
-        s.x = (p.x - worldLightPosition.x) / (p.y - worldLightPosition.y) * (s.y - worldLightPosition.y) + worldLightPosition.x; \n\
-        s.z = (p.z - worldLightPosition.z) / (p.y - worldLightPosition.y) * (s.y - worldLightPosition.y) + worldLightPosition.z; \n\
-        gl_Position = vec4(s, 1) * VP; \n\
-        } \n\
-        ";
-        
-        const char *fragmentSource = " \n\
-        #version 150 \n\
-        precision highp float; \n\
-        \n\
-        out vec4 fragmentColor; \n\
-        \n\
-        void main() { \n\
-        fragmentColor = vec4(0.0, 0.1, 0.0, 1); \n\
-        } \n\
-        ";
-        
-        unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
-        
-        glShaderSource(vertexShader, 1, &vertexSource, NULL);
-        glCompileShader(vertexShader);
-        checkShader(vertexShader, "Vertex shader error");
-        
-        unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-        if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
-        
-        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
-        glCompileShader(fragmentShader);
-        checkShader(fragmentShader, "Fragment shader error");
-        
-        shaderProgram = glCreateProgram();
-        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
-        
-        glAttachShader(shaderProgram, vertexShader);
-        glAttachShader(shaderProgram, fragmentShader);
+        position.clear(); velocity.clear(); acceleration.clear();
+        orientation.clear(); rotationRate.clear();
+        previousPosition.clear(); previousOrientation.clear();
+        type.clear(); avatar.clear(); canJump.clear();
+        random.clear();
+    }
+    
+    void BeginTick()
+    {
+        previousPosition = position;
+        previousOrientation = orientation;
+    }
+    
+    void ControlAvatar(int i, double dt, const InputState& input)
+    {
+        vec3& v = velocity[i];
+        if(input.arrowKeys[0]) {
+            v.x += -18*dt;
+        }
+        else if(input.arrowKeys[2]) {
+            v.x += 18*dt;
+        }
+        else if(input.arrowKeys[1]) {
+            v.z += -18*dt;
+        }
+        else if(input.arrowKeys[3]) {
+            v.z += 18*dt;
+        }
         
-        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
-        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
-        glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+        else if (input.keys[32] && canJump[i]) {
+            v.y += 180*dt;
+        }
+        else {
+            // the damping was tuned as a factor per 1/60 s tick
+            v.x = v.x*pow(.92, dt*60);
+            v.y = v.y*pow(.99, dt*60);
+            v.z = v.z*pow(.92, dt*60);
+        }
+        v = v + acceleration[i]*dt;
+    }
+    
+    void ControlObstacle(int i)
+    {
+        Random& random = this->random[i];
+        if(velocity[i].z == 0) {
+            double speed = random.NextInt(4)*3.0;
+            velocity[i].z = speed;
+        }
+        if (position[i].z >=3) {
+            double start_z = -6-random.NextInt(14);
+            position[i].z = start_z;
+            previousPosition[i] = position[i];
+            
+            double speed = random.NextInt(4)*1.5;
+            velocity[i].z = speed;
+        }
+    }
+    
+    // Control and Move only touch the entities in [begin, end), disjoint
+    // ranges can run at the same time
+    void Control(double dt, const InputState& input, int begin, int end)
+    {
+        for(int i = begin; i < end; i++) {
+            if(avatar[i]) ControlAvatar(i, dt, input);
+            if(type[i] == OBSTACLE) ControlObstacle(i);
+        }
+    }
+    
+    void Move(double dt, int begin, int end)
+    {
+        if(begin >= end) return;
+        AddScaledArrays(&position[begin].x, &velocity[begin].x, dt, (end - begin) * 3);
         
-        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+        for(int i = begin; i < end; i++) {
+            if(type[i] != TIGGER) continue;
+            if(fabs(position[i].x) > 2) {
+                velocity[i].x = velocity[i].x*(-0.5);
+            }
+            if(fabs(position[i].z + 2) > 2) {
+                velocity[i].z = velocity[i].z*(-0.5);
+            }
+        }
         
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
+        TurnAngles(&orientation[begin].x, &rotationRate[begin].x, dt, (end - begin) * 3);
     }
     
-    void UploadVP(mat4& VP)
+    void Move(double dt) { Move(dt, 0, Size()); }
+    
+    // what entity i does when it meets entity j. Only entity i changes;
+    // whether the meeting costs a life is returned rather than applied, the
+    // caller settles the shared game state
+    bool Interact(int i, int j)
     {
-        int location = glGetUniformLocation(shaderProgram, "VP");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, VP);
-        else printf("uniform VP cannot be set\n");
+        switch (type[i]) {
+            case TIGGER:
+                switch (type[j]) {
+                    case GROUND:
+                        if (position[i].y <= position[j].y) {
+                            velocity[i].y = velocity[i].y*(-1);
+                            position[i].y = position[j].y;
+                        }
+                        canJump[i] = position[i].y <= position[j].y + 0.2;
+                        
+                        break;
+                    case OBSTACLE:
+                        return position[i].y <= 0.4 && fabs(position[i].x-position[j].x) <= 0.5 && fabs(position[i].z-position[j].z) <= 0.8;
+                        
+                    default:
+                        break;
+                }
+                break;
+                
+            default:
+                break;
+        }
+        return false;
     }
     
-    void UploadM(mat4& M)
+    unsigned long long HashState(unsigned long long hash) const
     {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
+        for(int i = 0; i < Size(); i++) {
+            const vec3* state[3] = { &position[i], &velocity[i], &orientation[i] };
+            for(int k = 0; k < 3; k++) {
+                float v[3] = { state[k]->x, state[k]->y, state[k]->z };
+                hash = HashBytes(hash, v, sizeof(v));
+            }
+        }
+        return hash;
     }
+};
+
+
+// what rendering gets to see of the simulation after a tick: the entity
+// poses at the start and the end of the tick, the camera, and the game
+// state deciding what is drawn. Filled on the simulation thread, read on
+// the render thread
+struct Snapshot
+{
+    std::vector<vec3> position, previousPosition;
+    std::vector<vec3> orientation, previousOrientation;
+    vec3 eye, lookat, previousEye, previousLookat;
+    int score, lives, visible;
+    bool invincible, gameOver;
     
+    // wall-clock time the tick was due, rendering interpolates from there
+    std::chrono::steady_clock::time_point tickTime;
     
-    void UploadLightAttributes(vec4 worldLightPosition, vec3 La, vec3 Le) {
-        int location = glGetUniformLocation(shaderProgram, "worldLightPosition");
-        if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
-        else printf("uniform worldLightPosition cannot be set\n");
+    void Capture(const Entities& entities, Camera& camera)
+    {
+        position = entities.position;
+        previousPosition = entities.previousPosition;
+        orientation = entities.orientation;
+        previousOrientation = entities.previousOrientation;
+        camera.GetView(eye, lookat, previousEye, previousLookat);
+        score = ::score;
+        lives = ::lives;
+        visible = ::visible;
+        invincible = ::invincible;
+        gameOver = ::game_over;
     }
 };
 
+// three snapshots handed from the simulation thread to the render thread
+// without locks: the writer fills its own slot and swaps it into the
+// middle, the reader swaps its slot for the middle one whenever that holds
+// something newer. Neither waits for the other or touches the other's slot
+class SnapshotBuffer
+{
+    Snapshot slots[3];
+    
+    // the middle slot, with freshBit set until the reader has taken it
+    std::atomic<int> middle;
+    int writing, reading;
+    static const int freshBit = 4;
+    
+public:
+    SnapshotBuffer() : middle(1), writing(0), reading(2) {}
+    
+    Snapshot& Writable() { return slots[writing]; }
+    
+    void Publish() { writing = middle.exchange(writing | freshBit) & ~freshBit; }
+    
+    // the newest published snapshot, the same one again if nothing was
+    // published since; it stays the reader's until the next call
+    Snapshot& Latest()
+    {
+        if(middle.load() & freshBit) reading = middle.exchange(reading) & ~freshBit;
+        return slots[reading];
+    }
+};
 
 
-extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
-
-class Texture
+// a scene object as rendering sees it: mesh, place in the hierarchy and
+// cached transforms, with its simulation state in Entities
+class Object
 {
-    unsigned int textureId;
+    Mesh *mesh;
+    Object *parent;
+    
+    Entities& entities;
+    int entity;
+    
+    vec3 scaling;
+    
+    // cached transforms, row vectors as everywhere else: local is S * R * T,
+    // world is local * parent world. rotationScale (S * R) and its inverse
+    // only need the trigonometry again when the rendered orientation or
+    // scaling changes, a moved object just gets a new translation row
+    mat4 rotationScale, invRotationScale;
+    mat4 local, invLocal;
+    mat4 world, invWorld;
+    vec3 renderedPosition, renderedOrientation;
+    bool rotationScaleDirty;
+    bool localDirty;
+    
+    // frame of the last UpdateTransform, and whether world changed in it
+    unsigned int transformFrame;
+    bool worldChanged;
+    
+    void UpdateRotationScale(vec3 orientation)
+    {
+        rotationScale = ScaleRotationTranslation(scaling, orientation, vec3(0, 0, 0));
+        invRotationScale = rotationScale.AffineInverse();
+    }
+    
+    // S * R * T only differs from S * R in the translation row, and
+    // InvT * InvR * InvS only in -position * (InvR * InvS) there
+    void UpdateLocal(vec3 position)
+    {
+        local = rotationScale;
+        local.m[3][0] = position.x;
+        local.m[3][1] = position.y;
+        local.m[3][2] = position.z;
+        
+        invLocal = invRotationScale;
+        for(int j = 0; j < 3; j++)
+            invLocal.m[3][j] = -(position.x * invRotationScale.m[0][j] + position.y * invRotationScale.m[1][j] + position.z * invRotationScale.m[2][j]);
+    }
     
 public:
-    Texture(const std::string& inputFileName)
+    Object(Entities& entities, Mesh *m, vec3 position = vec3(0.0, 0.0, 0.0), vec3 scaling = vec3(1.0, 1.0, 1.0), vec3 orientation = vec3(0.0, 0.0, 0.0), vec3 rotationRate = vec3(0.0, 0.0, 0.0), Object* parent = nullptr, vec3 acceleration = vec3(0,0,0), OBJECT_TYPE obj_type = NONE, bool isAvatar = false) : entities(entities), scaling(scaling), parent(parent)
     {
-        unsigned char* data;
-        int width; int height; int nComponents = 4;
+        entity = entities.Add(position, orientation, rotationRate, acceleration, obj_type, isAvatar);
         
-        data = stbi_load(inputFileName.c_str(), &width, &height, &nComponents, 0);
+        // headless runs have no meshes, only the simulation state is used
+        mesh = m;
+        renderedPosition = position;
+        renderedOrientation = orientation;
+        rotationScaleDirty = true;
+        localDirty = true;
+        transformFrame = 0;
+        worldChanged = false;
+    }
+    
+    void SetScaling(vec3 _scaling) {
+        scaling = _scaling;
+        rotationScaleDirty = true;
+    }
+    
+    void SetParent(Object* _parent) {
+        parent = _parent;
+        localDirty = true;
+    }
+    
+    OBJECT_TYPE GetType() { return (OBJECT_TYPE)entities.type[entity]; }
+    
+    void setObjType(OBJECT_TYPE _obj_type) {
+        entities.type[entity] = _obj_type;
+    }
+    
+    bool IsAvatar() { return entities.avatar[entity] != 0; }
+    
+    // brings the cached matrices up to date for the given frame (counting
+    // from 1), alpha of the way from the previous tick's state to the
+    // current one. The parent is updated first, so visiting the objects in
+    // any order is one top-down pass over hierarchies of any depth; an
+    // object moved again within the frame is recomputed on the next call
+    void UpdateTransform(unsigned int frame, float alpha, const Snapshot& snapshot)
+    {
+        vec3 position = snapshot.position[entity];
+        vec3 orientation = snapshot.orientation[entity];
+        vec3 previousPosition = snapshot.previousPosition[entity];
+        vec3 previousOrientation = snapshot.previousOrientation[entity];
         
-        if(data == NULL)
-        {
-            return;
+        vec3 renderPosition = previousPosition + (position - previousPosition) * alpha;
+        
+        // angles wrap at 360, interpolate the short way round
+        vec3 turn = orientation - previousOrientation;
+        float* angles[3] = { &turn.x, &turn.y, &turn.z };
+        for(int i = 0; i < 3; i++) {
+            if(*angles[i] > 180) *angles[i] -= 360;
+            if(*angles[i] < -180) *angles[i] += 360;
         }
+        vec3 renderOrientation = previousOrientation + turn * alpha;
         
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+        if(renderOrientation != renderedOrientation) rotationScaleDirty = true;
+        if(renderPosition != renderedPosition) localDirty = true;
         
-        if(nComponents == 3) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-        if(nComponents == 4) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        if(transformFrame == frame && !localDirty && !rotationScaleDirty) return;
+        transformFrame = frame;
         
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        bool parentChanged = false;
+        if(parent) {
+            parent->UpdateTransform(frame, alpha, snapshot);
+            parentChanged = parent->worldChanged;
+        }
         
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        if(rotationScaleDirty) {
+            UpdateRotationScale(renderOrientation);
+            renderedOrientation = renderOrientation;
+            rotationScaleDirty = false;
+            localDirty = true;
+        }
         
-        delete data;
+        worldChanged = localDirty || parentChanged;
+        if(localDirty) {
+            UpdateLocal(renderPosition);
+            renderedPosition = renderPosition;
+            localDirty = false;
+        }
+        if(worldChanged) {
+            world = parent ? local * parent->world : local;
+            invWorld = parent ? parent->invWorld * invLocal : invLocal;
+        }
     }
     
-    void Bind()
+    vec3 GetWorldPosition() { return vec3(world.m[3][0], world.m[3][1], world.m[3][2]); }
+    
+    Object* GetParent() { return parent; }
+    
+    // the longest axis of the world matrix, how much it enlarges a length at most
+    float GetWorldScale()
     {
-        glBindTexture(GL_TEXTURE_2D, textureId);
+        float worldScale = 0;
+        for(int i = 0; i < 3; i++)
+            worldScale = std::max(worldScale, vec3(world.m[i][0], world.m[i][1], world.m[i][2]).length());
+        return worldScale;
     }
-};
-
-
-
-
-class Light
-{
-    vec3 La, Le;
-    vec4 worldLightPosition;
     
-public:
-    Light(vec4 _worldLightPosition, vec3 _La = vec3(1,1,1), vec3 _Le = vec3(1,1,1)) {
-        worldLightPosition = _worldLightPosition;
-        La = _La;
-        Le = _Le;
+    // the mesh bounds under the world matrix: a sphere and the box around
+    // the transformed object-space box, both centered on center; false for
+    // geometry without bounds
+    bool GetWorldBounds(vec3& center, float& radius, vec3& extent)
+    {
+        const BoundingVolume* bounds = mesh->GetGeometry()->GetBounds();
+        if(!bounds) return false;
+        
+        vec4 c = vec4(bounds->center.x, bounds->center.y, bounds->center.z, 1) * world;
+        center = vec3(c.v[0], c.v[1], c.v[2]);
+        radius = bounds->radius * GetWorldScale();
+        
+        vec3 e = (vec3(bounds->max) - bounds->min) * 0.5f;
+        extent = vec3(fabs(world.m[0][0]) * e.x + fabs(world.m[1][0]) * e.y + fabs(world.m[2][0]) * e.z,
+                      fabs(world.m[0][1]) * e.x + fabs(world.m[1][1]) * e.y + fabs(world.m[2][1]) * e.z,
+                      fabs(world.m[0][2]) * e.x + fabs(world.m[1][2]) * e.y + fabs(world.m[2][2]) * e.z);
+        return true;
     }
     
-    
-    void UploadAttributes(Shader* s) {
-        s->UploadLightAttributes(worldLightPosition, La, Le);
-    }
-          
-          
-    void SetPointLightSource(vec3& pos) {
-        worldLightPosition = vec4(pos.x,pos.y, pos.z, 1);
+    // coarsest level of detail whose error, projected to the screen,
+    // stays within lodErrorThreshold pixels
+    int SelectLod()
+    {
+        Geometry* geometry = mesh->GetGeometry();
+        int lod = geometry->GetLodCount() - 1;
+        if(lod == 0) return 0;
+        
+        float worldScale = GetWorldScale();
+        vec3 worldPosition = GetWorldPosition();
+        
+        while(lod > 0 && camera.GetProjectedSize(geometry->GetLodError(lod) * worldScale, worldPosition) > lodErrorThreshold) lod--;
+        return lod;
     }
     
-    void SetDirectionalLightSource(vec3& dir) {
-        worldLightPosition = vec4(dir.x,dir.y, dir.z, 0);
+    Mesh* GetMesh() { return mesh; }
+    
+    // expects UpdateTransform to have run this frame
+    void WriteUniforms(ObjectUniformBlock& block, FrameUniformBlock& frame)
+    {
+        block.M = world;
+        block.InvM = invWorld;
+        block.MVP = world * frame.VP;
+        
+        block.lightIndex[0] = IsAvatar() || (parent && parent->IsAvatar()) ? SPOT_LIGHT : SUN_LIGHT;
+        block.lightIndex[1] = block.lightIndex[2] = block.lightIndex[3] = 0;
     }
 };
 
-Light light(vec4(0,2,2,1));
 
-class Material
+
+
+// uniform grid on the ground plane, hashed into a table rebuilt every tick:
+// objects are inserted with their cell, Build sorts them by bucket in one
+// counting pass, a query returns everything in the buckets of the cells a
+// square around a point touches. Cells sharing a bucket only cost extra
+// candidates, callers run the exact test anyway.
+class SpatialHash
 {
-    Shader* shader;
-    Texture* texture;
-    vec3 ka, kd, ks;
-    float shininess;
+    float cellSize;
+    unsigned int tableMask;
+    std::vector<int> ids;
+    std::vector<int> cellX, cellZ;
+    std::vector<int> cellStart;
+    std::vector<int> entries;
+    
+    int Cell(float coordinate) { return (int)floor(coordinate / cellSize); }
+    
+    unsigned int Bucket(int x, int z) { return ((unsigned int)x * 73856093u ^ (unsigned int)z * 19349663u) & tableMask; }
     
 public:
-    Material(Shader* s, vec3 _ka, vec3 _kd, vec3 _ks, float _shininess, Texture* t = 0)
+    SpatialHash(float cellSize = 1.0f) : cellSize(cellSize), tableMask(0) {}
+    
+    void Clear()
     {
-        shader = s;
-        ka = _ka;
-        kd = _kd;
-        ks = _ks;
-        shininess = _shininess;
-        texture = t;
+        ids.clear();
+        cellX.clear();
+        cellZ.clear();
     }
     
-    Shader* GetShader() { return shader; }
+    void Insert(int id, vec3 position)
+    {
+        ids.push_back(id);
+        cellX.push_back(Cell(position.x));
+        cellZ.push_back(Cell(position.z));
+    }
     
-    void UploadAttributes()
+    void Build()
+    {
+        // about two buckets per object keeps the chains short
+        unsigned int tableSize = 16;
+        while(tableSize < 2 * ids.size()) tableSize *= 2;
+        tableMask = tableSize - 1;
+        
+        cellStart.assign(tableSize + 1, 0);
+        for(int i = 0; i < ids.size(); i++) cellStart[Bucket(cellX[i], cellZ[i]) + 1]++;
+        for(int i = 0; i < tableSize; i++) cellStart[i + 1] += cellStart[i];
+        
+        entries.resize(ids.size());
+        std::vector<int> next(cellStart.begin(), cellStart.end() - 1);
+        for(int i = 0; i < ids.size(); i++) entries[next[Bucket(cellX[i], cellZ[i])]++] = ids[i];
+    }
+    
+    // appends the ids near the square of half size extent around position,
+    // an id can be appended more than once
+    void Query(vec3 position, float extent, std::vector<int>& result)
     {
-        if(texture)
+        if(entries.empty()) return;
+        
+        for(int x = Cell(position.x - extent); x <= Cell(position.x + extent); x++)
         {
-            shader->UploadSamplerID();
-            texture->Bind();
-            shader->UploadMaterialAttributes(ka, kd, ks, shininess);
+            for(int z = Cell(position.z - extent); z <= Cell(position.z + extent); z++)
+            {
+                unsigned int bucket = Bucket(x, z);
+                result.insert(result.end(), entries.begin() + cellStart[bucket], entries.begin() + cellStart[bucket + 1]);
+            }
         }
-        else
-            shader->UploadMaterialAttributes(ka, kd, ks, shininess);
     }
 };
 
 
-
-
-
-class Mesh
+// a fixed pool of worker threads with a job deque each. ParallelFor cuts a
+// range into chunks of grain items dealt round-robin across the deques;
+// every thread, the caller included, takes work from the back of its own
+// deque and, once that is empty, steals from the front of the others.
+// Chunks depend only on the range and the grain, never on the thread
+// count, so results kept per chunk and combined in chunk order come out
+// the same on any number of cores
+class JobSystem
 {
-    Geometry* geometry;
-    Material* material;
+    struct Job
+    {
+        int begin, end;
+    };
     
-public:
-    Mesh(Geometry* g, Material* m)
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+    
+    typedef std::function<void(int begin, int end, int worker)> Body;
+    
+    // queues[0] is worked by the thread calling ParallelFor
+    std::vector<Queue*> queues;
+    std::vector<std::thread> threads;
+    
+    const Body* body;
+    std::atomic<int> remaining;
+    
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    unsigned int generation;
+    bool quit;
+    
+    bool Pop(int worker, Job& job)
+    {
+        Queue& queue = *queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if(queue.jobs.empty()) return false;
+        job = queue.jobs.back();
+        queue.jobs.pop_back();
+        return true;
+    }
+    
+    bool Steal(int worker, Job& job)
     {
-        geometry = g;
-        material = m;
+        for(int k = 1; k < queues.size(); k++) {
+            Queue& queue = *queues[(worker + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if(queue.jobs.empty()) continue;
+            job = queue.jobs.front();
+            queue.jobs.pop_front();
+            return true;
+        }
+        return false;
     }
     
-    Shader* GetShader() { return material->GetShader(); }
+    void RunJobs(int worker)
+    {
+        Job job;
+        while(Pop(worker, job) || Steal(worker, job)) {
+            (*body)(job.begin, job.end, worker);
+            remaining--;
+        }
+    }
     
-    void Draw()
+    void WorkerLoop(int worker)
     {
-        material->UploadAttributes();
-        geometry->Draw();
+        unsigned int seen = 0;
+        for(;;) {
+            {
+                std::unique_lock<std::mutex> lock(wakeMutex);
+                wake.wait(lock, [&] { return quit || generation != seen; });
+                if(quit) return;
+                seen = generation;
+            }
+            RunJobs(worker);
+        }
     }
-};
-
-
-
-
-
-class Camera {
-    vec3  wEye, wLookat, wVup, velocity;
-    float fov, asp, fp, bp, speed, angularVelocity;
     
 public:
-    Camera()
+    JobSystem() : body(0), remaining(0), generation(0), quit(false)
     {
-        wEye = vec3(1.0, 0.0, 3.0);
-        wLookat = vec3(0.5, 0.0, 0.0);
-        wVup = vec3(0.0, 1.0, 0.0);
-        velocity = vec3(0.0,0.0,0.0);
-        angularVelocity =0;
-        fov = M_PI / 4.0; asp = 1.0; fp = 0.01; bp = 20.0;
+        queues.push_back(new Queue());
     }
     
-    vec3 getEyePosition() {
-        return wEye;
+    ~JobSystem()
+    {
+        Stop();
+        delete queues[0];
     }
     
-    void SetAspectRatio(float a) { asp = a; }
-    
-    void Move() {
-        wEye = wEye + velocity;
-        wLookat = wLookat +velocity;
+    // nThreads counts the calling thread, 0 means one per core
+    void Start(int nThreads)
+    {
+        Stop();
+        if(nThreads <= 0) nThreads = std::max((int)std::thread::hardware_concurrency(), 1);
         
-        vec3 r = cross(GetAhead(), wVup.normalize());
-        float d = wLookat.length();
-        if(d != 0) { wLookat = wLookat.normalize(); }
-        wLookat = (wLookat*cos(angularVelocity) + r*sin(angularVelocity))*d;
+        quit = false;
+        for(int i = 1; i < nThreads; i++) queues.push_back(new Queue());
+        for(int i = 1; i < nThreads; i++) threads.push_back(std::thread(&JobSystem::WorkerLoop, this, i));
     }
     
-    void Control(float dt) {
-        if(keyboardState['d']) {
-            angularVelocity = 2.0*dt;
-        }
-        else if(keyboardState['a']) {
-            angularVelocity = -2.0*dt;
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            quit = true;
         }
-        else {
-            angularVelocity = 0;
+        wake.notify_all();
+        for(int i = 0; i < threads.size(); i++) threads[i].join();
+        threads.clear();
+        for(int i = 1; i < queues.size(); i++) delete queues[i];
+        queues.resize(1);
+    }
+    
+    int GetThreadCount() { return (int)queues.size(); }
+    
+    // runs body over [0, n) in chunks and returns once all of them are done
+    void ParallelFor(int n, int grain, const Body& f)
+    {
+        int nChunks = (n + grain - 1) / grain;
+        if(nChunks <= 1 || queues.size() == 1) {
+            for(int begin = 0; begin < n; begin += grain) f(begin, std::min(begin + grain, n), 0);
+            return;
         }
         
-        if(keyboardState['w']) {
-            velocity = GetAhead() * 1.5*dt;
+        body = &f;
+        remaining = nChunks;
+        for(int c = 0; c < nChunks; c++) {
+            Job job = { c * grain, std::min((c + 1) * grain, n) };
+            Queue& queue = *queues[c % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.jobs.push_back(job);
         }
-        else if(keyboardState['s']) {
-            velocity = GetAhead() * -1.5*dt;
-        }
-//        else if(arrowKeyState[0]) {
-//            velocity.x = -2.0*dt;
-//        }
-//        else if(arrowKeyState[2]) {
-//            velocity.x = 2.0*dt;
-//        }
-//        else if(arrowKeyState[1]) {
-//            velocity.z = -2.0*dt;
-//        }
-//        else if(arrowKeyState[3]) {
-//            velocity.z = 2.0*dt;
-//        }
-        else {
-            velocity = vec3(0.0,0.0,0.0);
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            generation++;
         }
+        wake.notify_all();
         
-        if(keyboardState['T'] || keyboardState['t']) {
-            double theta = trackingT;
-            // derivative of the heart curve
-            velocity.x = 48*cos(theta)*pow(sin(theta), 2)/10.0*dt;
-            velocity.z = -1*(-13*sin(theta)+10*sin(2*theta)+6*sin(3*theta)+4*sin(4*theta))/10.0*dt;
-            trackingT += dt;
+        RunJobs(0);
+        while(remaining > 0) std::this_thread::yield();
+    }
+};
+
+// simulation work is spread over these (--threads)
+JobSystem jobs;
+
+// entities per Control/Move job, and interacting objects per collision job
+const int entityJobGrain = 4096;
+const int interactJobGrain = 64;
+
+
+// the six planes of the volume a view-projection matrix maps into clip
+// space, n.p + d >= 0 inside (Gribb and Hartmann); with row vectors clip
+// coordinate j is column j of the matrix
+struct Frustum
+{
+    float planes[6][4];
+    
+    Frustum(const mat4& VP)
+    {
+        for(int k = 0; k < 3; k++)
+            for(int i = 0; i < 4; i++) {
+                planes[2 * k][i] = VP.m[i][3] + VP.m[i][k];
+                planes[2 * k + 1][i] = VP.m[i][3] - VP.m[i][k];
+            }
+        for(int k = 0; k < 6; k++) {
+            float length = sqrt(planes[k][0] * planes[k][0] + planes[k][1] * planes[k][1] + planes[k][2] * planes[k][2]);
+            if(length > 0) for(int i = 0; i < 4; i++) planes[k][i] /= length;
         }
     }
     
-    void UploadAttributes(Shader* s) {
-        s->UploadEyePosition(wEye);
+    float Distance(int k, const vec3& p) const
+    {
+        return planes[k][0] * p.x + planes[k][1] * p.y + planes[k][2] * p.z + planes[k][3];
     }
     
-    vec3 GetAhead() {
-        return (wLookat-wEye).normalize();
+    bool SphereOutside(const vec3& center, float radius) const
+    {
+        for(int k = 0; k < 6; k++) if(Distance(k, center) < -radius) return true;
+        return false;
     }
     
-    mat4 GetViewMatrix()
+    bool BoxOutside(const vec3& center, const vec3& extent) const
     {
-        vec3 w = (wEye - wLookat).normalize();
-        vec3 u = cross(wVup, w).normalize();
-        vec3 v = cross(w, u);
-        
-        return
-        mat4(
-             1.0f,    0.0f,    0.0f,    0.0f,
-             0.0f,    1.0f,    0.0f,    0.0f,
-             0.0f,    0.0f,    1.0f,    0.0f,
-             -wEye.x, -wEye.y, -wEye.z, 1.0f ) *
-        mat4(
-             u.x,  v.x,  w.x,  0.0f,
-             u.y,  v.y,  w.y,  0.0f,
-             u.z,  v.z,  w.z,  0.0f,
-             0.0f, 0.0f, 0.0f, 1.0f );
+        for(int k = 0; k < 6; k++) {
+            float reach = fabs(planes[k][0]) * extent.x + fabs(planes[k][1]) * extent.y + fabs(planes[k][2]) * extent.z;
+            if(Distance(k, center) < -reach) return true;
+        }
+        return false;
     }
     
-    mat4 GetProjectionMatrix()
+    // a sphere swept from a to b misses the volume when both ends lie
+    // outside the same plane
+    bool SweptSphereOutside(const vec3& a, float radiusA, const vec3& b, float radiusB) const
     {
-        float sy = 1/tan(fov/2);
-        return mat4(
-                    sy/asp, 0.0f,  0.0f,               0.0f,
-                    0.0f,   sy,    0.0f,               0.0f,
-                    0.0f,   0.0f, -(fp+bp)/(bp - fp), -1.0f,
-                    0.0f,   0.0f, -2*fp*bp/(bp - fp),  0.0f);
+        for(int k = 0; k < 6; k++) if(Distance(k, a) < -radiusA && Distance(k, b) < -radiusB) return true;
+        return false;
     }
 };
 
-Camera camera;
-
-
 
+// the passes of a frame in drawing order: the casters into the shadow map
+// (SHADOW_MAP mode), objects, the shadows they cast onto the ground plane
+// (PLANAR_SHADOWS mode), then the ground, which lies behind nearly
+// everything and so mostly fails the early depth test
+enum RENDER_PASS { SHADOW_MAP_PASS, OPAQUE_PASS, SHADOW_PASS, BACKGROUND_PASS };
 
+// what the render queue submitted in the last frame, next to what drawing
+// the same items one call each in scene order would have taken
+struct RenderQueueStats
+{
+    int items, drawCalls, programChanges, textureChanges;
+    int unsortedProgramChanges, unsortedTextureChanges;
+    int culledObjects, culledShadows;
+};
 
-class Object
+class Scene
 {
-    Shader* shader;
-    ShadowShader* shadowShader;
-    Mesh *mesh;
-    Object *parent;
-    
-    bool isAvatar;
-    vec3 sunPos;
-    vec3 scaling;
-    
-    vec3 orientation;
-    vec3 rotationRate;
+    MeshShader *meshShader;
+    InfiniteMeshShader *infiniteMeshShader;
+    ShadowShader *shadowShader;
+    ShadowMapShader *shadowMapShader;
+    ShadowMap shadowMap;
     
-    vec3 velocity;
-    vec3 acceleration;
+    std::vector<Texture*> textures;
+    std::vector<Material*> materials;
+    std::vector<Geometry*> geometries;
+    std::vector<Mesh*> meshes;
+    std::vector<Object*> objects;
+    Entities entities;
     
+    // one object to draw in one pass. Sorted by key the items are grouped
+    // by pass, program, texture and mesh and go front to back within each
+    // group; a run of items with the same pass, mesh and level of detail
+    // is drawn as instances of one call per MAX_DRAW_INSTANCES
+    struct DrawItem
+    {
+        unsigned long long key;
+        Object* object;
+        int lod;
+        RENDER_PASS pass;
+        int uniforms;
+    };
     
-    bool can_jump;
+    // one instanced call, replayed after the uniforms are uploaded
+    struct DrawRecord
+    {
+        int firstItem;
+        int uniformOffset;
+        int nInstances;
+    };
     
+    UniformBuffers uniformBuffers;
+    FrameUniformBlock frameUniforms;
+    std::vector<DrawItem> drawItems;
+    std::vector<ObjectUniformBlock> itemUniforms, runUniforms;
+    std::vector<DrawRecord> drawRecords;
+    RenderQueueStats renderStats;
     
-public:
-    OBJECT_TYPE obj_type;
-    vec3 position;
-
+    unsigned int transformFrame;
     
-    Object(Mesh *m, vec3 position = vec3(0.0, 0.0, 0.0), vec3 scaling = vec3(1.0, 1.0, 1.0), vec3 orientation = vec3(0.0, 0.0, 0.0), vec3 rotationRate = vec3(0.0, 0.0, 0.0), Object* parent = nullptr, vec3 acceleration = vec3(0,0,0), OBJECT_TYPE obj_type = NONE, bool isAvatar = false) : position(position), scaling(scaling), orientation(orientation), rotationRate(rotationRate), parent(parent), acceleration(acceleration), obj_type(obj_type), isAvatar(isAvatar)
+    // world bounds of every object for culling, and of the hierarchy below
+    // it (itself and all its descendants); a negative radius is unbounded
+    struct CullBounds
     {
-        shader = m->GetShader();
-        mesh = m;
-        sunPos = vec3(0.0, 400.0, 200.0);
-    }
-    
-    void setObjType(OBJECT_TYPE _obj_type) {
-        obj_type = _obj_type;
-    }
-    
-    void Draw()
+        vec3 center, extent;
+        float radius;
+        vec3 hierarchyCenter;
+        float hierarchyRadius;
+    };
+    std::vector<int> parentIndex;
+    std::vector<CullBounds> cullBounds;
+    std::vector<char> hierarchyCulled, viewCulled, shadowCulled;
+    
+    // object indices per type that takes part in some rule, the types that
+    // have rules of their own (the rest are only met), and a grid for each
+    // type some rule reaches into
+    std::vector<int> objectsByType[OBJECT_TYPE_COUNT];
+    bool interactingTypes[OBJECT_TYPE_COUNT];
+    bool initiatingTypes[OBJECT_TYPE_COUNT];
+    bool hashedTypes[OBJECT_TYPE_COUNT];
+    SpatialHash typeGrids[OBJECT_TYPE_COUNT];
+    
+    // candidate lists per worker thread, lives lost per collision job
+    std::vector<std::vector<int> > workerCandidates;
+    std::vector<int> chunkHits;
+    
+    // an obstacle hit on the avatar, ignored while it is invincible
+    static void Hit()
     {
-        shader->Run();
-        UploadAttributes();
-        
-        if(isAvatar || (parent && parent->isAvatar)) {
-            vec3 spotlightPos = camera.getEyePosition()+ vec3(0,2.0,0);
-            light.SetPointLightSource(spotlightPos);
+        if(invincible) return;
+        lives--;
+        if(lives == 0) {
+            game_over = true;
         }
         else {
-            light.SetDirectionalLightSource(sunPos);
+            invincible = true;
         }
-        light.UploadAttributes(shader);
-        
-        camera.UploadAttributes(shader);
-        
-        
-        mesh->Draw();
     }
     
-    void DrawShadow(Shader* shadowShader)
+    // from the top: pass 4 bits, program 10, texture 10, vertex array 10,
+    // level of detail 6 and depth 24. GL names are cut to their low bits, which
+    // can only cost a state change: runs compare the objects, not the keys
+    static unsigned long long SortKey(RENDER_PASS pass, unsigned int program, unsigned int texture, unsigned int vertexArray, int lod, float depth)
     {
-        shadowShader->Run();
-        
-        UploadAttributes(shadowShader);
-        
-
-        light.SetDirectionalLightSource(sunPos);
-        light.UploadAttributes(shadowShader);
-        
-        camera.UploadAttributes(shadowShader);
-        
-        mesh->Draw();
+        unsigned long long depthBits = (unsigned long long)(std::min(std::max(depth, 0.0f), 1.0f) * 0xffffff);
+        return (unsigned long long)pass << 60 | (unsigned long long)(program & 0x3ff) << 50 |
+            (unsigned long long)(texture & 0x3ff) << 40 | (unsigned long long)(vertexArray & 0x3ff) << 30 |
+            (unsigned long long)(lod & 0x3f) << 24 | depthBits;
     }
-
     
-    void UploadAttributes()
+    void Queue(Object* object, RENDER_PASS pass, bool visible, bool castsShadow)
     {
-
-        mat4 T = mat4(
-                      1.0,			0.0,			0.0,			0.0,
-                      0.0,			1.0,			0.0,			0.0,
-                      0.0,			0.0,			1.0,			0.0,
-                      position.x,	position.y,     position.z,		1.0);
-        
-        mat4 InvT = mat4(
-                         1.0,			0.0,			0.0,			0.0,
-                         0.0,			1.0,			0.0,			0.0,
-                         0.0,			0.0,			1.0,			0.0,
-                         -position.x,	-position.y,	-position.z,	1.0);
-        
-        mat4 S = mat4(
-                      scaling.x,		0.0,			0.0,			0.0,
-                      0.0,			scaling.y,		0.0,			0.0,
-                      0.0,			0.0,			scaling.z,		0.0,
-                      0.0,			0.0,			0.0,			1.0);
-        
-        mat4 InvS = mat4(
-                         1.0/scaling.x,	0.0,			0.0,			0.0,
-                         0.0,			1.0/scaling.y,	0.0,			0.0,
-                         0.0,			0.0,			1.0/scaling.z,	0.0,
-                         0.0,			0.0,			0.0,			1.0);
-       
-        mat4 R[3];
-        mat4 InvR[3];
-
-        float alpha = orientation.x / 180.0 * M_PI;
-        R[0] = mat4(
-                       1.0,			0.0,			0.0,			0.0,
-                       0.0,			cos(alpha),		sin(alpha),		0.0,
-                       0.0,			-sin(alpha),	cos(alpha),		0.0,
-                       0.0,			0.0,			0.0,			1.0);
-        
-        InvR[0] = mat4(
-                       1.0,			0.0,			0.0,			0.0,
-                       0.0,			cos(alpha),		-sin(alpha),	0.0,
-                       0.0,			sin(alpha),     cos(alpha),		0.0,
-                       0.0,			0.0,			0.0,			1.0);
-        
-        alpha = orientation.y / 180.0 * M_PI;
-        R[1] = mat4(
-                      cos(alpha),	0.0,			sin(alpha),		0.0,
-                      0.0,			1.0,			0.0,			0.0,
-                      -sin(alpha),	0.0,			cos(alpha),		0.0,
-                      0.0,			0.0,			0.0,			1.0);
-        
-        InvR[1] = mat4(
-                         cos(alpha),	0.0,			-sin(alpha),	0.0,
-                         0.0,			1.0,			0.0,			0.0,
-                         sin(alpha),	0.0,			cos(alpha),		0.0,
-                         0.0,			0.0,			0.0,			1.0);
-        
-        alpha = orientation.z / 180.0 * M_PI;
-        R[2] = mat4(
-                       cos(alpha),		sin(alpha),		0.0,            0.0,
-                       -sin(alpha),		cos(alpha),		0.0,			0.0,
-                       0.0,             0.0,			1.0,            0.0,
-                       0.0,             0.0,			0.0,			1.0);
-        
-        InvR[2] = mat4(
-                          cos(alpha),		-sin(alpha),	0.0,            0.0,
-                          sin(alpha),		cos(alpha),		0.0,			0.0,
-                          0.0,              0.0,			1.0,            0.0,
-                          0.0,              0.0,			0.0,			1.0);
-        
-        mat4 M = S * R[0] * R[1] * R[2] * T;
-        mat4 InvM = InvT * InvR[2] * InvR[1] * InvR[0] * InvS;
-        
-        
-        if (parent) {
-            T = mat4(
-                          1.0,			0.0,			0.0,			0.0,
-                          0.0,			1.0,			0.0,			0.0,
-                          0.0,			0.0,			1.0,			0.0,
-                          parent->position.x,	parent->position.y,     parent->position.z,		1.0);
-            
-            InvT = mat4(
-                             1.0,			0.0,			0.0,			0.0,
-                             0.0,			1.0,			0.0,			0.0,
-                             0.0,			0.0,			1.0,			0.0,
-                             -parent->position.x,	-parent->position.y,	-parent->position.z,	1.0);
-            
-            S = mat4(
-                          parent->scaling.x,		0.0,			0.0,			0.0,
-                          0.0,			parent->scaling.y,		0.0,			0.0,
-                          0.0,			0.0,			parent->scaling.z,		0.0,
-                          0.0,			0.0,			0.0,			1.0);
-            
-            InvS = mat4(
-                             1.0/parent->scaling.x,	0.0,			0.0,			0.0,
-                             0.0,			1.0/parent->scaling.y,	0.0,			0.0,
-                             0.0,			0.0,			1.0/parent->scaling.z,	0.0,
-                             0.0,			0.0,			0.0,			1.0);
-            
-            
-            alpha = parent->orientation.x / 180.0 * M_PI;
-            R[0] = mat4(
-                        1.0,			0.0,			0.0,			0.0,
-                        0.0,			cos(alpha),		sin(alpha),		0.0,
-                        0.0,			-sin(alpha),	cos(alpha),		0.0,
-                        0.0,			0.0,			0.0,			1.0);
-            
-            InvR[0] = mat4(
-                           1.0,			0.0,			0.0,			0.0,
-                           0.0,			cos(alpha),		-sin(alpha),	0.0,
-                           0.0,			sin(alpha),     cos(alpha),		0.0,
-                           0.0,			0.0,			0.0,			1.0);
-            
-            alpha = parent->orientation.y / 180.0 * M_PI;
-            R[1] = mat4(
-                        cos(alpha),	0.0,			sin(alpha),		0.0,
-                        0.0,			1.0,			0.0,			0.0,
-                        -sin(alpha),	0.0,			cos(alpha),		0.0,
-                        0.0,			0.0,			0.0,			1.0);
-            
-            InvR[1] = mat4(
-                           cos(alpha),	0.0,			-sin(alpha),	0.0,
-                           0.0,			1.0,			0.0,			0.0,
-                           sin(alpha),	0.0,			cos(alpha),		0.0,
-                           0.0,			0.0,			0.0,			1.0);
-            
-            alpha = parent->orientation.z / 180.0 * M_PI;
-            R[2] = mat4(
-                        cos(alpha),		sin(alpha),		0.0,            0.0,
-                        -sin(alpha),		cos(alpha),		0.0,			0.0,
-                        0.0,             0.0,			1.0,            0.0,
-                        0.0,             0.0,			0.0,			1.0);
-            
-            InvR[2] = mat4(
-                           cos(alpha),		-sin(alpha),	0.0,            0.0,
-                           sin(alpha),		cos(alpha),		0.0,			0.0,
-                           0.0,              0.0,			1.0,            0.0,
-                           0.0,              0.0,			0.0,			1.0);
-            
-            mat4 parentM = S * R[0] * R[1] * R[2] * T;
-            mat4 parentInvM = InvT * InvR[2] * InvR[1] * InvR[0] * InvS;
-            
-            M = M * parentM;
-            InvM = parentInvM * InvM;
-        }
+        if(!visible && !castsShadow) return;
+        
+        int lod = object->SelectLod();
+        float depth = camera.GetDepth(object->GetWorldPosition());
         
+        itemUniforms.push_back(ObjectUniformBlock());
+        object->WriteUniforms(itemUniforms.back(), frameUniforms);
         
+        Mesh* mesh = object->GetMesh();
+        Texture* texture = mesh->GetMaterial()->GetTexture();
+        unsigned int vertexArray = mesh->GetGeometry()->GetVertexArray();
         
-        mat4 MVP = M * camera.GetViewMatrix() * camera.GetProjectionMatrix();
+        DrawItem item = { SortKey(pass, mesh->GetShader()->GetProgram(), texture ? texture->GetId() : 0, vertexArray, lod, depth),
+                          object, lod, pass, (int)itemUniforms.size() - 1 };
+        if(visible) drawItems.push_back(item);
+        
+        // a caster is drawn into the shadow map at the level of detail the camera sees
+        if(castsShadow && shadowMode == SHADOW_MAP) {
+            item.key = SortKey(SHADOW_MAP_PASS, shadowMapShader->GetProgram(), 0, vertexArray, lod, depth);
+            item.pass = SHADOW_MAP_PASS;
+            drawItems.push_back(item);
+        }
         
-        shader->UploadInvM(InvM);
-        shader->UploadMVP(MVP);
-        shader->UploadM(M);
+        // every planar shadow of a mesh draws the same proxy, whatever its level of detail
+        else if(castsShadow) {
+            item.key = SortKey(SHADOW_PASS, shadowShader->GetProgram(), 0, vertexArray, 0, depth);
+            item.lod = 0;
+            item.pass = SHADOW_PASS;
+            drawItems.push_back(item);
+        }
     }
     
+    Shader* ItemShader(const DrawItem& item)
+    {
+        if(item.pass == SHADOW_MAP_PASS) return shadowMapShader;
+        return item.pass == SHADOW_PASS ? shadowShader : item.object->GetMesh()->GetShader();
+    }
     
-    void UploadAttributes(Shader* shadowShader)
+    // shadows are flat and depth only, the shadow shaders read no material
+    Material* ItemMaterial(const DrawItem& item)
     {
-        mat4 T = mat4(
-                      1.0,			0.0,			0.0,			0.0,
-                      0.0,			1.0,			0.0,			0.0,
-                      0.0,			0.0,			1.0,			0.0,
-                      position.x,		position.y,		position.z,		1.0);
-        
-        mat4 S = mat4(
-                      scaling.x,		0.0,			0.0,			0.0,
-                      0.0,			scaling.y,		0.0,			0.0,
-                      0.0,			0.0,			scaling.z,		0.0,
-                      0.0,			0.0,			0.0,			1.0);
-        
-        mat4 R[3];
-        
-        float alpha = orientation.x / 180.0 * M_PI;
-        R[0] = mat4(
-                    1.0,		0.0,			0.0,            0.0,
-                    0.0,		cos(alpha),		sin(alpha),		0.0,
-                    0.0,        -sin(alpha),	cos(alpha),		0.0,
-                    0.0,		0.0,			0.0,			1.0);
-        
-        
-        alpha = orientation.y / 180.0 * M_PI;
-        R[1] = mat4(
-                    cos(alpha),		0.0,			sin(alpha),		0.0,
-                    0.0,			1.0,			0.0,			0.0,
-                    -sin(alpha),	0.0,			cos(alpha),		0.0,
-                    0.0,			0.0,			0.0,			1.0);
-        
-        alpha = orientation.z / 180.0 * M_PI;
-        R[2] = mat4(
-                    cos(alpha),		sin(alpha),		0.0,            0.0,
-                    -sin(alpha),	cos(alpha),		0.0,			0.0,
-                    0.0,             0.0,			1.0,            0.0,
-                    0.0,             0.0,			0.0,			1.0);
-        
-        
-        mat4 M = S * R[0] * R[1] * R[2] * T;
-        mat4 V = camera.GetViewMatrix();
-        mat4 P = camera.GetProjectionMatrix();
-        
-        if (parent) {
-            T = mat4(
-                     1.0,			0.0,			0.0,			0.0,
-                     0.0,			1.0,			0.0,			0.0,
-                     0.0,			0.0,			1.0,			0.0,
-                     parent->position.x,	parent->position.y,     parent->position.z,		1.0);
-            
-            S = mat4(
-                     parent->scaling.x,		0.0,			0.0,			0.0,
-                     0.0,			parent->scaling.y,		0.0,			0.0,
-                     0.0,			0.0,			parent->scaling.z,		0.0,
-                     0.0,			0.0,			0.0,			1.0);
-            
-            
-            alpha = parent->orientation.x / 180.0 * M_PI;
-            R[0] = mat4(
-                        1.0,			0.0,			0.0,			0.0,
-                        0.0,			cos(alpha),		sin(alpha),		0.0,
-                        0.0,			-sin(alpha),	cos(alpha),		0.0,
-                        0.0,			0.0,			0.0,			1.0);
-            
-            alpha = parent->orientation.y / 180.0 * M_PI;
-            R[1] = mat4(
-                        cos(alpha),	0.0,			sin(alpha),		0.0,
-                        0.0,			1.0,			0.0,			0.0,
-                        -sin(alpha),	0.0,			cos(alpha),		0.0,
-                        0.0,			0.0,			0.0,			1.0);
-            
-            alpha = parent->orientation.z / 180.0 * M_PI;
-            R[2] = mat4(
-                        cos(alpha),		sin(alpha),		0.0,            0.0,
-                        -sin(alpha),	cos(alpha),		0.0,			0.0,
-                        0.0,             0.0,			1.0,            0.0,
-                        0.0,             0.0,			0.0,			1.0);
-            
-            mat4 parentM = S * R[0] * R[1] * R[2] * T;
-            
-            M = M * parentM;
-        }
-
-        mat4 VP = V*P;
-        
-        shadowShader->UploadM(M);
-        shadowShader->UploadVP(VP);
+        return item.pass == SHADOW_PASS || item.pass == SHADOW_MAP_PASS ? 0 : item.object->GetMesh()->GetMaterial();
     }
-
     
-    void Control(double dt) {
-        if(isAvatar) {
-            if(arrowKeyState[0]) {
-                velocity.x += -0.3*dt;
-            }
-            else if(arrowKeyState[2]) {
-                velocity.x += 0.3*dt;
-            }
-            else if(arrowKeyState[1]) {
-                velocity.z += -0.3*dt;
-            }
-            else if(arrowKeyState[3]) {
-                velocity.z += 0.3*dt;
-            }
-            
-            else if (keyboardState[32] && can_jump) {
-                velocity.y += 3*dt;
-            }
-            else {
-                velocity.x = velocity.x*.92;
-                velocity.y = velocity.y*.99;
-                velocity.z = velocity.z*.92;
-            }
-            velocity = velocity + acceleration*dt;
-        }
-        
-        if(obj_type==OBSTACLE) {
-            if(velocity.z == 0) {
-                double speed = (rand()%4)/20.0+1/20;
-                velocity.z = speed;
-            }
-            if (position.z >=3) {
-                double start_z = -6-rand()%14;
-                position.z = start_z;
-                
-                double speed = (rand()%4)/40.0+1/20;
-                velocity.z = speed;
-            }
+    bool SameCall(const DrawItem& a, const DrawItem& b)
+    {
+        return a.pass == b.pass && a.lod == b.lod && a.object->GetMesh() == b.object->GetMesh();
+    }
+    
+    // grows the sphere (center, radius) to hold the other one
+    static void MergeSphere(vec3& center, float& radius, vec3 otherCenter, float otherRadius)
+    {
+        vec3 d = otherCenter - center;
+        float distance = d.length();
+        if(distance + otherRadius <= radius) return;
+        if(distance + radius <= otherRadius) {
+            center = otherCenter;
+            radius = otherRadius;
+            return;
         }
-
+        float merged = (distance + radius + otherRadius) / 2;
+        center = center + d * ((merged - radius) / distance);
+        radius = merged;
     }
     
-    void Move() {
-        position = position + velocity;
-        if(obj_type == TIGGER ) {
-            if(fabs(position.x) > 2) {
-                velocity.x = velocity.x*(-0.5);
-            }
-            if(fabs(position.z + 2) > 2) {
-                velocity.z = velocity.z*(-0.5);
-            }
+    // expects the transforms of the frame; parents are created before their
+    // children, so one backwards pass hands every hierarchy up to its root
+    void UpdateCullBounds()
+    {
+        if(parentIndex.size() != objects.size()) {
+            std::unordered_map<Object*, int> indexOf;
+            for(int i = 0; i < objects.size(); i++) indexOf[objects[i]] = i;
+            parentIndex.assign(objects.size(), -1);
+            for(int i = 0; i < objects.size(); i++)
+                if(objects[i]->GetParent()) parentIndex[i] = indexOf[objects[i]->GetParent()];
         }
-
         
-        if(rotationRate.x != 0) {
-            orientation.x += rotationRate.x;
-            while(orientation.x >= 360) {
-                orientation.x -= 360;
-            }
-        }
-        if(rotationRate.y != 0) {
-            orientation.y += rotationRate.y;
-            while(orientation.y >= 360) {
-                orientation.y -= 360;
-            }
+        cullBounds.resize(objects.size());
+        for(int i = 0; i < objects.size(); i++) {
+            CullBounds& b = cullBounds[i];
+            if(!objects[i]->GetWorldBounds(b.center, b.radius, b.extent)) b.radius = -1;
+            b.hierarchyCenter = b.center;
+            b.hierarchyRadius = b.radius;
         }
-        if(rotationRate.z != 0) {
-            orientation.z += rotationRate.z;
-            while(orientation.z >= 360) {
-                orientation.z -= 360;
-            }
+        for(int i = objects.size() - 1; i >= 0; i--) {
+            int p = parentIndex[i];
+            if(p < 0 || cullBounds[p].hierarchyRadius < 0) continue;
+            if(cullBounds[i].hierarchyRadius < 0) cullBounds[p].hierarchyRadius = -1;
+            else MergeSphere(cullBounds[p].hierarchyCenter, cullBounds[p].hierarchyRadius,
+                             cullBounds[i].hierarchyCenter, cullBounds[i].hierarchyRadius);
         }
     }
     
-    void Interact(Object* object) {
-        switch (obj_type) {
-            case TIGGER:
-                switch (object->obj_type) {
-                    case GROUND:
-                        if (position.y <= object->position.y) {
-                            velocity.y = velocity.y*(-1);
-                            position.y = object->position.y;
-                        }
-                        can_jump = position.y <= object->position.y + 0.2;
-
-                        break;
-                    case OBSTACLE:
-                        if(position.y <= 0.4 && fabs(position.x-object->position.x) <= 0.5 && fabs(position.z-object->position.z) <= 0.8 && !invincible) {
-                            lives--;
-                            if(lives == 0) {
-                                game_over = true;
-                            }
-                            else {
-                                invincible = true;
-                            }
-                        }
-                        
-                    default:
-                        break;
-                }
-                break;
-                
-            default:
-                break;
+    // marks the objects whose spheres outside(center, radius) rejects. A
+    // hierarchy outside as a whole is rejected with one test and its
+    // descendants are not visited; boxes, when given, get a second, tighter
+    // test after the sphere passed
+    template<typename Outside> void Cull(std::vector<char>& culled, Outside outside, const Frustum* boxes)
+    {
+        culled.assign(objects.size(), false);
+        hierarchyCulled.assign(objects.size(), false);
+        for(int i = 0; i < objects.size(); i++) {
+            int p = parentIndex[i];
+            const CullBounds& b = cullBounds[i];
+            if(p >= 0 && hierarchyCulled[p]) {
+                hierarchyCulled[i] = culled[i] = true;
+                continue;
+            }
+            hierarchyCulled[i] = b.hierarchyRadius >= 0 && outside(b.hierarchyCenter, b.hierarchyRadius);
+            culled[i] = hierarchyCulled[i] ||
+                (b.radius >= 0 && (outside(b.center, b.radius) || (boxes && boxes->BoxOutside(b.center, b.extent))));
         }
     }
-};
-
-
-
-
-class Scene
-{
-    MeshShader *meshShader;
-    InfiniteMeshShader *infiniteMeshShader;
-    ShadowShader *shadowShader;
     
-    std::vector<Texture*> textures;
-    std::vector<Material*> materials;
-    std::vector<Geometry*> geometries;
-    std::vector<Mesh*> meshes;
-    std::vector<Object*> objects;
+    bool InView(Object* object, const Frustum& view)
+    {
+        vec3 center, extent;
+        float radius;
+        if(!object->GetWorldBounds(center, radius, extent)) return true;
+        return !view.SphereOutside(center, radius) && !view.BoxOutside(center, extent);
+    }
     
 public:
     Scene()
     {
+        for(int type = 0; type < OBJECT_TYPE_COUNT; type++) interactingTypes[type] = initiatingTypes[type] = hashedTypes[type] = false;
+        for(int type = 0; type < OBJECT_TYPE_COUNT; type++) {
+            for(int other = 0; other < OBJECT_TYPE_COUNT; other++) {
+                const InteractionRule& rule = interactionRules[type][other];
+                if(!rule.active) continue;
+                interactingTypes[type] = interactingTypes[other] = true;
+                initiatingTypes[type] = true;
+                if(rule.reach > 0) hashedTypes[other] = true;
+            }
+        }
+
         meshShader = 0;
         infiniteMeshShader = 0;
         shadowShader = 0;
+        shadowMapShader = 0;
+        transformFrame = 0;
+        memset(&renderStats, 0, sizeof(renderStats));
     }
     
-    void Initialize()
+    // without graphics no GL call is made and objects get no meshes,
+    // which is all the simulation needs
+    void Initialize(bool graphics = true)
     {
+        if(!graphics) {
+            meshes.assign(5, (Mesh*)0);
+            InitializeObjects();
+            return;
+        }
+        
         meshShader = new MeshShader();
         infiniteMeshShader = new InfiniteMeshShader();
         shadowShader = new ShadowShader();
+        shadowMapShader = new ShadowMapShader();
+        
+        uniformBuffers.Initialize();
         
         vec3 ka = vec3(0.2,0.2,0.2);
         vec3 kd = vec3(0.6, 0.6, 0.6);
@@ -1701,47 +4024,51 @@ public:
         
         materials.push_back(new Material(infiniteMeshShader, ka, kd, ks, shininess, textures[textures.size()-1]));
         
-        geometries.push_back(new PolygonalMesh("Meshes/tigger.obj"));
-        geometries.push_back(new PolygonalMesh("Meshes/chevy/chevy.obj"));
-        geometries.push_back(new PolygonalMesh("Meshes/chevy/wheel.obj"));
-        geometries.push_back(new PolygonalMesh("Meshes/heart/heart.obj"));
-        geometries.push_back(new InfiniteTexturedQuad());
+        geometries.push_back(new PolygonalMesh("Meshes/tigger.obj", sceneVertexFormat));
+        geometries.push_back(new PolygonalMesh("Meshes/chevy/chevy.obj", sceneVertexFormat));
+        geometries.push_back(new PolygonalMesh("Meshes/chevy/wheel.obj", sceneVertexFormat));
+        geometries.push_back(new PolygonalMesh("Meshes/heart/heart.obj", sceneVertexFormat));
+        geometries.push_back(new InfiniteTexturedQuad(sceneVertexFormat));
         
         for (int i = 0; i < geometries.size()-1 && i < materials.size()-1; i++) {
             meshes.push_back(new Mesh(geometries[i], materials[i]));
         }
         meshes.push_back(new Mesh(geometries[geometries.size()-1], materials[materials.size()-1]));
         
-        
-        Object* tigger = new Object(meshes[0], vec3(0.0, 0.0, -2.0), vec3(0.04, 0.04, 0.04), vec3(0,90.0,0), vec3(0.0,0.0,0.0), nullptr,vec3(0,-.2,0), TIGGER, true);
+        InitializeObjects();
+    }
+    
+    void InitializeObjects()
+    {
+        Object* tigger = new Object(entities, meshes[0], vec3(0.0, 0.0, -2.0), vec3(0.04, 0.04, 0.04), vec3(0,90.0,0), vec3(0.0,0.0,0.0), nullptr,vec3(0,-12,0), TIGGER, true);
         objects.push_back(tigger);
         
         
-        for (int i=0; i < 4; i++) {
-            Object* chevy = new Object(meshes[1], vec3(-1.5+i, -0.7, 10), vec3(0.04, 0.04, 0.04), vec3(0.0,0.0,0), vec3(0.0,0.0,0.0), nullptr, false);
+        for (int i=0; i < carCount; i++) {
+            Object* chevy = new Object(entities, meshes[1], vec3(-1.5+i%4, -0.7, 10), vec3(0.04, 0.04, 0.04), vec3(0.0,0.0,0), vec3(0.0,0.0,0.0), nullptr, false);
             chevy->setObjType(OBSTACLE);
             objects.push_back(chevy);
             
             vec3 xOffset = vec3(6.5,0.0,0.0);
             vec3 yOffset = vec3(0.0,4.0,0.0);
             vec3 zOffset = vec3(0.0,0.0,11.15);
-            Object* wheel = new Object(meshes[2], xOffset-yOffset+zOffset*(1.25), vec3(1,1,1), vec3(0,0,0), vec3(3.0,0.0,0.0), chevy);
+            Object* wheel = new Object(entities, meshes[2], xOffset-yOffset+zOffset*(1.25), vec3(1,1,1), vec3(0,0,0), vec3(180.0,0.0,0.0), chevy);
             objects.push_back(wheel);
-            wheel = new Object(meshes[2], xOffset*(-1)-yOffset+zOffset*(1.25), vec3(1,1,1), vec3(0,0,0), vec3(3.0,0.0,0.0), chevy);
+            wheel = new Object(entities, meshes[2], xOffset*(-1)-yOffset+zOffset*(1.25), vec3(1,1,1), vec3(0,0,0), vec3(180.0,0.0,0.0), chevy);
             objects.push_back(wheel);
-            wheel = new Object(meshes[2], xOffset-yOffset-zOffset, vec3(1,1,1), vec3(0,0,0), vec3(3.0,0.0,0.0), chevy);
+            wheel = new Object(entities, meshes[2], xOffset-yOffset-zOffset, vec3(1,1,1), vec3(0,0,0), vec3(180.0,0.0,0.0), chevy);
             objects.push_back(wheel);
-            wheel = new Object(meshes[2], xOffset*(-1)-yOffset-zOffset, vec3(1,1,1), vec3(0,0,0), vec3(3.0,0.0,0.0), chevy);
+            wheel = new Object(entities, meshes[2], xOffset*(-1)-yOffset-zOffset, vec3(1,1,1), vec3(0,0,0), vec3(180.0,0.0,0.0), chevy);
             objects.push_back(wheel);
         }
 
-        Object* heart = new Object(meshes[3], vec3(0,2,-3), vec3(.02,.02,.02), vec3(-90,0,0));
+        Object* heart = new Object(entities, meshes[3], vec3(0,2,-3), vec3(.02,.02,.02), vec3(-90,0,0));
         heart->setObjType(HEART);
         objects.push_back(heart);
 
         
-        //ground always must be last object so it's shadow isn't drawn
-        Object* ground = new Object(meshes[meshes.size()-1], vec3(0.0, -1.0, 0));
+        //the ground casts no shadow and is drawn in the background pass
+        Object* ground = new Object(entities, meshes[meshes.size()-1], vec3(0.0, -1.0, 0));
         ground->setObjType(GROUND);
         objects.push_back(ground);
     }
@@ -1757,65 +4084,298 @@ public:
         if(meshShader) delete meshShader;
     }
     
-    void Draw()
+    // alpha is how far the frame is between the previous tick and the current
+    // one; the snapshot belongs to the caller, the heart is placed in it once
+    // per life
+    void Draw(Snapshot& snapshot, float alpha)
     {
+        camera.SetView(snapshot.eye, snapshot.lookat, snapshot.previousEye, snapshot.previousLookat);
+        
+        vec3 spotlightPos = camera.getEyePosition() + vec3(0,2.0,0);
+        lights[SPOT_LIGHT].SetPointLightSource(spotlightPos);
+        
+        if(shadowMode == SHADOW_MAP) shadowMap.Initialize();
+        
+        camera.WriteUniforms(frameUniforms, alpha);
+        for(int i = 0; i < LIGHT_SLOT_COUNT; i++) lights[i].WriteUniforms(frameUniforms, i);
+        shadowMap.WriteUniforms(frameUniforms, lights[SUN_LIGHT].GetWorldPosition(),
+                                camera.getEyePosition() + camera.GetAhead() * ShadowMap::radius);
+        uniformBuffers.UploadFrame(frameUniforms);
+        
+        drawItems.clear();
+        itemUniforms.clear();
+        
+        transformFrame++;
+        for(int i = 0; i < objects.size(); i++) objects[i]->UpdateTransform(transformFrame, alpha, snapshot);
+        
+        // objects against the view frustum; planar shadows against it swept
+        // from each caster to the shadow it throws on the ground, shadow map
+        // casters against the volume the map covers
+        Frustum view(frameUniforms.VP);
+        UpdateCullBounds();
+        Cull(viewCulled, [&](const vec3& center, float radius) { return view.SphereOutside(center, radius); }, &view);
+        if(shadowMode == SHADOW_MAP) {
+            Frustum sun(frameUniforms.lightVP);
+            Cull(shadowCulled, [&](const vec3& center, float radius) { return sun.SphereOutside(center, radius); }, &sun);
+        }
+        else {
+            vec3 light(frameUniforms.worldLightPositions[SUN_LIGHT][0], frameUniforms.worldLightPositions[SUN_LIGHT][1],
+                       frameUniforms.worldLightPositions[SUN_LIGHT][2]);
+            Cull(shadowCulled, [&](const vec3& center, float radius) {
+                vec3 ray = vec3(center) - light;
+                if(ray.y >= 0) return view.SphereOutside(center, radius);
+                // ShadowShader projects from the light onto y = -0.999, which
+                // stretches the sphere by the distance ratio and the slant
+                float t = (-0.999f - light.y) / ray.y;
+                float slant = fabs(ray.y) / ray.length();
+                return view.SweptSphereOutside(center, radius, light + ray * t, radius * t / std::max(slant, 0.1f));
+            }, 0);
+        }
+        
+        int culledObjects = 0, culledShadows = 0;
         for(int i = 0; i < objects.size(); i++) {
-            switch (objects[i]->obj_type) {
+            bool visible = !viewCulled[i], castsShadow = !shadowCulled[i];
+            switch (objects[i]->GetType()) {
                 case HEART:
-                    for (int j = 0; j < lives; j++) {
-                        objects[i]->position.x = -2.3+0.5*j;
-                        objects[i]->Draw();
+                    for (int j = 0; j < snapshot.lives; j++) {
+                        snapshot.position[i].x = -2.3+0.5*j;
+                        snapshot.previousPosition[i] = snapshot.position[i];
+                        objects[i]->UpdateTransform(transformFrame, alpha, snapshot);
+                        visible = InView(objects[i], view);
+                        if(!visible) culledObjects++;
+                        Queue(objects[i], OPAQUE_PASS, visible, false);
                     }
                     break;
                 
                 case TIGGER:
-                    if(!invincible || visible <= 3 || game_over) {
-                        objects[i]->Draw();
-                        objects[i]->DrawShadow(shadowShader);
+                    if(!snapshot.invincible || snapshot.visible <= 3 || snapshot.gameOver) {
+                        culledObjects += !visible;
+                        culledShadows += !castsShadow;
+                        Queue(objects[i], OPAQUE_PASS, visible, castsShadow);
                     }
                     break;
                 
                 case GROUND:
-                    objects[i]->Draw();
+                    culledObjects += !visible;
+                    Queue(objects[i], BACKGROUND_PASS, visible, false);
                     break;
                     
                 default:
-                    if(!game_over) {
-                        objects[i]->Draw();
-                        objects[i]->DrawShadow(shadowShader);
+                    if(!snapshot.gameOver) {
+                        culledObjects += !visible;
+                        culledShadows += !castsShadow;
+                        Queue(objects[i], OPAQUE_PASS, visible, castsShadow);
                     }
                     break;
             }
         }
+        
+        // the baseline: every item its own call, in the order it was queued
+        memset(&renderStats, 0, sizeof(renderStats));
+        renderStats.culledObjects = culledObjects;
+        renderStats.culledShadows = culledShadows;
+        renderStats.items = (int)drawItems.size();
+        for(int i = 0; i < drawItems.size(); i++) {
+            if(i == 0 || ItemShader(drawItems[i]) != ItemShader(drawItems[i - 1])) renderStats.unsortedProgramChanges++;
+            if(ItemMaterial(drawItems[i]) && (i == 0 || ItemMaterial(drawItems[i]) != ItemMaterial(drawItems[i - 1]) ||
+                                              ItemShader(drawItems[i]) != ItemShader(drawItems[i - 1])))
+                renderStats.unsortedTextureChanges++;
+        }
+        
+        std::stable_sort(drawItems.begin(), drawItems.end(), [](const DrawItem& a, const DrawItem& b) { return a.key < b.key; });
+        
+        uniformBuffers.BeginObjects();
+        drawRecords.clear();
+        for(int first = 0; first < drawItems.size(); ) {
+            int end = first + 1;
+            while(end < drawItems.size() && end - first < MAX_DRAW_INSTANCES && SameCall(drawItems[first], drawItems[end])) end++;
+            
+            runUniforms.clear();
+            for(int i = first; i < end; i++) runUniforms.push_back(itemUniforms[drawItems[i].uniforms]);
+            
+            DrawRecord record;
+            record.firstItem = first;
+            record.nInstances = end - first;
+            record.uniformOffset = uniformBuffers.PushObjects(&runUniforms[0], record.nInstances);
+            drawRecords.push_back(record);
+            first = end;
+        }
+        uniformBuffers.UploadObjects();
+        
+        // the program and the material are only set when they change; a
+        // new program needs the material uniforms again
+        Shader* currentShader = 0;
+        Material* currentMaterial = 0;
+        bool inShadowMap = shadowMode == SHADOW_MAP;
+        if(inShadowMap) shadowMap.Begin();
+        for(int i = 0; i < drawRecords.size(); i++) {
+            DrawRecord& record = drawRecords[i];
+            DrawItem& item = drawItems[record.firstItem];
+            
+            if(inShadowMap && item.pass != SHADOW_MAP_PASS) {
+                shadowMap.End();
+                inShadowMap = false;
+            }
+            
+            Shader* shader = ItemShader(item);
+            if(shader != currentShader) {
+                shader->Run();
+                currentShader = shader;
+                currentMaterial = 0;
+                renderStats.programChanges++;
+            }
+            Material* material = ItemMaterial(item);
+            if(material && material != currentMaterial) {
+                material->UploadAttributes();
+                currentMaterial = material;
+                renderStats.textureChanges++;
+            }
+            
+            uniformBuffers.BindObjects(record.uniformOffset);
+            Geometry* geometry = item.object->GetMesh()->GetGeometry();
+            if(item.pass == SHADOW_PASS) geometry->DrawShadowInstanced(record.nInstances);
+            else geometry->DrawInstanced(item.lod, record.nInstances);
+            renderStats.drawCalls++;
+        }
+        if(inShadowMap) shadowMap.End();
     }
     
+    const RenderQueueStats& GetRenderStats() { return renderStats; }
+    
+    // broad phase: objects are bucketed by type and only the pairs
+    // interactionRules marks active are gathered. Types met within a reach
+    // are hashed by cell, so an object only meets the ones around it. The
+    // candidates are visited in object order, as the all-pairs loop did.
     void Interact() {
-        for(int i = 0; i < objects.size(); i++) {
-            for(int j = 0; j < objects.size(); j++) {
-                if(i != j) {
-                    objects[i]->Interact(objects[j]);
+        for(int type = 0; type < OBJECT_TYPE_COUNT; type++) objectsByType[type].clear();
+        for(int i = 0; i < entities.Size(); i++) {
+            if(interactingTypes[entities.type[i]]) objectsByType[entities.type[i]].push_back(i);
+        }
+        
+        for(int type = 0; type < OBJECT_TYPE_COUNT; type++) {
+            if(!hashedTypes[type]) continue;
+            typeGrids[type].Clear();
+            for(int k = 0; k < objectsByType[type].size(); k++) {
+                int j = objectsByType[type][k];
+                typeGrids[type].Insert(j, entities.position[j]);
+            }
+            typeGrids[type].Build();
+        }
+        
+        workerCandidates.resize(jobs.GetThreadCount());
+        for(int type = 0; type < OBJECT_TYPE_COUNT; type++) {
+            // a type that is only ever met has nothing to look for
+            if(!initiatingTypes[type]) continue;
+            const std::vector<int>& group = objectsByType[type];
+            int nChunks = ((int)group.size() + interactJobGrain - 1) / interactJobGrain;
+            chunkHits.assign(nChunks, 0);
+            
+            // each object only changes itself, the lives it costs are
+            // counted per job and settled below in object order
+            jobs.ParallelFor((int)group.size(), interactJobGrain, [&](int begin, int end, int worker) {
+                std::vector<int>& candidates = workerCandidates[worker];
+                int& hits = chunkHits[begin / interactJobGrain];
+                for(int k = begin; k < end; k++) {
+                    int i = group[k];
+                    
+                    candidates.clear();
+                    for(int other = 0; other < OBJECT_TYPE_COUNT; other++) {
+                        const InteractionRule& rule = interactionRules[type][other];
+                        if(!rule.active) continue;
+                        if(rule.reach > 0)
+                            typeGrids[other].Query(entities.position[i], rule.reach, candidates);
+                        else
+                            candidates.insert(candidates.end(), objectsByType[other].begin(), objectsByType[other].end());
+                    }
+                    if(candidates.empty()) continue;
+                    
+                    std::sort(candidates.begin(), candidates.end());
+                    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+                    
+                    for(int c = 0; c < candidates.size(); c++) {
+                        if(candidates[c] != i && entities.Interact(i, candidates[c])) hits++;
+                    }
                 }
+            });
+            
+            for(int c = 0; c < nChunks; c++) {
+                for(int h = 0; h < chunkHits[c]; h++) Hit();
             }
         }
     }
     
-    void Control(double dt)
+    void Seed(unsigned long long seed) { entities.Seed(seed); }
+    
+    void Control(double dt, const InputState& input)
     {
-        for(int i = 0; i < objects.size(); i++) objects[i]->Control(dt);
+        jobs.ParallelFor(entities.Size(), entityJobGrain, [&](int begin, int end, int worker) {
+            entities.Control(dt, input, begin, end);
+        });
+    }
+    
+    unsigned long long HashState(unsigned long long hash) const {
+        return entities.HashState(hash);
+    }
+    
+    void TakeSnapshot(Snapshot& snapshot, Camera& camera) {
+        snapshot.Capture(entities, camera);
     }
     
     
     
-    void Move() {
-        for(int i = 0; i < objects.size(); i++) objects[i]->Move();
+    void Move(double dt) {
+        jobs.ParallelFor(entities.Size(), entityJobGrain, [&](int begin, int end, int worker) {
+            entities.Move(dt, begin, end);
+        });
+    }
+    
+    void BeginTick() {
+        entities.BeginTick();
     }
 };
 
 Scene scene;
 
+// seconds of simulated play, advanced only by SimulationTick
+double simulationTime = 0.0;
+double invincibleStartTime = 0.0;
+
+// the simulation thread publishes here, onIdle picks the latest up for the
+// next frame together with where it is between the snapshot's two ticks
+SnapshotBuffer snapshots;
+Snapshot* renderSnapshot = 0;
+float renderAlpha = 1.0f;
+
+// prints what the render queue submitted and the GL state changes it took
+// about once a second (--render-stats)
+bool printRenderStats = false;
+
+// frames --bench-shadows draws with planar shadows and then with the shadow
+// map before it prints how long a frame took in each mode and exits
+int shadowBenchmarkFrames = 0;
+
+// a frame is timed up to glFinish, so its GPU work is included; the first
+// frame of each mode compiles and allocates what the mode needs and is not counted
+void BenchmarkShadowFrame(double milliseconds)
+{
+    static int frame = 0;
+    static double total[2] = { 0, 0 };
+    
+    if(frame % shadowBenchmarkFrames != 0) total[shadowMode] += milliseconds;
+    frame++;
+    
+    if(frame == shadowBenchmarkFrames) shadowMode = SHADOW_MAP;
+    if(frame == 2 * shadowBenchmarkFrames) {
+        int n = shadowBenchmarkFrames - 1;
+        printf("%d cars, %d frames each: planar shadows %.3f ms/frame, %dx%d shadow map %.3f ms/frame\n",
+               carCount, n, total[PLANAR_SHADOWS] / n, shadowMapSize, shadowMapSize, total[SHADOW_MAP] / n);
+        exit(0);
+    }
+}
+
 void onInitialization()
 {
-    glViewport(0, 0, windowWidth, windowHeight);
+    glState.Viewport(0, 0, windowWidth, windowHeight);
     
     scene.Initialize();
 }
@@ -1827,11 +4387,31 @@ void onExit()
 
 void onDisplay()
 {
+    glState.BeginFrame();
+    std::chrono::high_resolution_clock::time_point frameStart = std::chrono::high_resolution_clock::now();
     
     glClearColor(0, 0, 1.0, 0);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     
-    scene.Draw();
+    if(renderSnapshot) scene.Draw(*renderSnapshot, renderAlpha);
+    
+    if(shadowBenchmarkFrames > 0) {
+        glFinish();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - frameStart;
+        BenchmarkShadowFrame(elapsed.count());
+    }
+    
+    static int lastStatsTime = 0;
+    int time = glutGet(GLUT_ELAPSED_TIME);
+    if(printRenderStats && time - lastStatsTime >= 1000) {
+        const RenderQueueStats& stats = scene.GetRenderStats();
+        printf("render queue: %d items in %d draw calls, %d program and %d texture changes (unsorted: %d calls, %d program and %d texture changes), %d objects and %d shadows culled\n",
+               stats.items, stats.drawCalls, stats.programChanges, stats.textureChanges,
+               stats.items, stats.unsortedProgramChanges, stats.unsortedTextureChanges, stats.culledObjects, stats.culledShadows);
+        const GLStateStats& stateStats = glState.GetStats();
+        printf("gl state: %d changes made, %d redundant ones filtered\n", stateStats.issued, stateStats.filtered);
+        lastStatsTime = time;
+    }
     
     glutSwapBuffers();
     
@@ -1861,47 +4441,666 @@ void onKeyboardUp(unsigned char key, int x, int y)
 void onReshape(int winWidth, int winHeight)
 {
     camera.SetAspectRatio((float)winWidth / winHeight);
-    glViewport(0, 0, winWidth, winHeight);
+    camera.SetScreenHeight(winHeight);
+    glState.Viewport(0, 0, winWidth, winHeight);
 }
 
-void onIdle( ) {
-    double t = glutGet(GLUT_ELAPSED_TIME) * 0.001;
-    static double lastTime = 0.0;
-    double dt = t - lastTime;
-    lastTime = t;
+// input recordings (--record, --replay): a header with everything a run
+// depends on besides the input, then one event per key that changed, stamped
+// with the tick it changed on. Keys are numbered as in InputState
+struct InputRecordingHeader
+{
+    char magic[4];
+    unsigned int version;
+    unsigned long long seed;
+    double tickRate;
+    int carCount;
+    unsigned int nTicks;
+};
+
+struct InputEvent
+{
+    unsigned int tick;
+    unsigned short key;
+    unsigned char pressed;
+    unsigned char padding;
+};
+
+const unsigned int inputRecordingVersion = 2;
+const int inputKeyCount = 256 + 4;
+
+class InputRecorder
+{
+    FILE* file;
+    InputRecordingHeader header;
+    bool recorded[inputKeyCount];
     
-    if(!game_over) {
-        score = int(t);
+public:
+    InputRecorder() : file(0) {}
+    ~InputRecorder() { Close(); }
+    
+    bool IsOpen() { return file != 0; }
+    
+    bool Open(const char* filename)
+    {
+        file = fopen(filename, "wb");
+        if(!file) return false;
+        
+        InputRecordingHeader h = { { 'T', 'C', 'I', 'R' }, inputRecordingVersion, randomSeed, tickRate, carCount, 0 };
+        header = h;
+        for(int key = 0; key < inputKeyCount; key++) recorded[key] = false;
+        return fwrite(&header, sizeof(header), 1, file) == 1;
     }
-    else if(score > best_score) {
-        std::string data;
-        std::ofstream myfile("best_score.txt");
-        myfile << std::to_string(score);
-        myfile.close();
+    
+    // stores the keys of the tick that changed since the previous one
+    void RecordTick(InputState& input)
+    {
+        for(int key = 0; key < inputKeyCount; key++) {
+            if(input.Key(key) == recorded[key]) continue;
+            recorded[key] = input.Key(key);
+            InputEvent event = { header.nTicks, (unsigned short)key, (unsigned char)recorded[key], 0 };
+            fwrite(&event, sizeof(event), 1, file);
+        }
+        header.nTicks++;
+    }
+    
+    // the tick count goes into the header last, so this also runs on exit
+    void Close()
+    {
+        if(!file) return;
+        fseek(file, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, file);
+        fclose(file);
+        file = 0;
+    }
+};
+
+class InputReplay
+{
+    std::vector<InputEvent> events;
+    int nextEvent;
+    unsigned int tick;
+    bool replayed[inputKeyCount];
+    
+public:
+    InputRecordingHeader header;
+    
+    InputReplay() : nextEvent(0), tick(0) { header.nTicks = 0; }
+    
+    bool Open(const char* filename)
+    {
+        FILE* file = fopen(filename, "rb");
+        if(!file) return false;
+        
+        bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.magic, "TCIR", 4) == 0 && header.version == inputRecordingVersion;
+        InputEvent event;
+        while(ok && fread(&event, sizeof(event), 1, file) == 1) {
+            if(event.key < inputKeyCount) events.push_back(event);
+        }
+        fclose(file);
+        
+        if(!ok) header.nTicks = 0;
+        for(int key = 0; key < inputKeyCount; key++) replayed[key] = false;
+        return ok;
     }
     
-    camera.Control(dt);
-    camera.Move();
+    bool IsPlaying() { return tick < header.nTicks; }
     
-    static double invicible_start_t = 0.0;
-    if(t - invicible_start_t > 3.0) {
+    // the recorded keys of the next tick, in place of the live ones
+    void ReplayTick(InputState& input)
+    {
+        while(nextEvent < events.size() && events[nextEvent].tick == tick) {
+            replayed[events[nextEvent].key] = events[nextEvent].pressed != 0;
+            nextEvent++;
+        }
+        for(int key = 0; key < inputKeyCount; key++) input.Key(key) = replayed[key];
+        if(++tick == header.nTicks) printf("replay finished after %u ticks\n", tick);
+    }
+};
+
+InputRecorder inputRecorder;
+InputReplay inputReplay;
+
+// one fixed step of the game, everything that changes state happens here
+void SimulationTick(double dt)
+{
+    InputState input;
+    if(inputReplay.IsPlaying()) inputReplay.ReplayTick(input);
+    else input.Sample();
+    if(inputRecorder.IsOpen()) inputRecorder.RecordTick(input);
+    
+    simulationTime += dt;
+    
+    if(!game_over) {
+        score = int(simulationTime);
+    }
+    
+    simulationCamera.BeginTick();
+    scene.BeginTick();
+    
+    simulationCamera.Control(dt, input);
+    simulationCamera.Move(dt);
+    
+    if(simulationTime - invincibleStartTime > 3.0) {
         invincible = false;
     }
-    if(invincible) { visible = (visible+1)%5; }
-    if(!invincible) { invicible_start_t = t; }
+    // blinks through a 5 step cycle 12 times a second, hidden in the last step
+    if(invincible) { visible = int((simulationTime - invincibleStartTime) * 60) % 5; }
+    if(!invincible) { invincibleStartTime = simulationTime; }
 
     
     scene.Interact();
-    scene.Control(dt);
-    scene.Move();
+    scene.Control(dt, input);
+    scene.Move(dt);
+}
+
+// runs the fixed ticks on a thread of its own and publishes a snapshot
+// after every batch of them, so a frame waiting on the GPU never holds up
+// input or physics. A batch is at most maxCatchUpTicks long; a thread too
+// slow to catch up drops the backlog, keeping the phase
+class SimulationThread
+{
+    std::thread thread;
+    std::atomic<bool> quit;
+    
+    void Run()
+    {
+        typedef std::chrono::steady_clock clock;
+        clock::time_point lastTime = clock::now();
+        double accumulator = 0.0;
+        while(!quit) {
+            clock::time_point t = clock::now();
+            accumulator += std::chrono::duration<double>(t - lastTime).count();
+            lastTime = t;
+            
+            double tickTime = 1.0 / tickRate;
+            int ticks = 0;
+            while(accumulator >= tickTime && ticks < maxCatchUpTicks) {
+                SimulationTick(tickTime);
+                accumulator -= tickTime;
+                ticks++;
+            }
+            if(accumulator >= tickTime) accumulator = fmod(accumulator, tickTime);
+            
+            if(ticks > 0) {
+                Snapshot& snapshot = snapshots.Writable();
+                scene.TakeSnapshot(snapshot, simulationCamera);
+                snapshot.tickTime = t - std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(accumulator));
+                snapshots.Publish();
+            }
+            
+            std::this_thread::sleep_for(std::chrono::duration<double>(tickTime - accumulator));
+        }
+    }
+    
+public:
+    SimulationThread() : quit(false) {}
+    
+    // joined before the scene it runs goes away, also when GLUT exits
+    ~SimulationThread() { Stop(); }
+    
+    // publishes the state as it is first, so there is always a snapshot to draw
+    void Start()
+    {
+        Snapshot& snapshot = snapshots.Writable();
+        scene.TakeSnapshot(snapshot, simulationCamera);
+        snapshot.tickTime = std::chrono::steady_clock::now();
+        snapshots.Publish();
+        
+        quit = false;
+        thread = std::thread(&SimulationThread::Run, this);
+    }
+    
+    void Stop()
+    {
+        quit = true;
+        if(thread.joinable()) thread.join();
+    }
+};
+
+SimulationThread simulationThread;
+
+void onIdle( ) {
+    renderSnapshot = &snapshots.Latest();
+    double sinceTick = std::chrono::duration<double>(std::chrono::steady_clock::now() - renderSnapshot->tickTime).count();
+    renderAlpha = std::min(std::max(sinceTick * tickRate, 0.0), 1.0);
+    
+    int score = renderSnapshot->score;
+    if(renderSnapshot->gameOver && score > best_score) {
+        std::string data;
+        std::ofstream myfile("best_score.txt");
+        myfile << std::to_string(score);
+        myfile.close();
+    }
     
     std::string title = "SCORE: " + std::to_string(score) + ", BEST SCORE: " + std::to_string(best_score);
     glutSetWindowTitle(title.c_str());
     glutPostRedisplay();
 }
 
+// loads the game's mesh assets repeatedly without a GL context and reports the
+// time to parse and index the .obj text, the time the build flags then add
+// on top (LODs, shadow proxy, cache optimization) and the time to map the
+// binary cache, run with: tigger-and-cars --bench-load [iterations]
+const char* meshAssets[] = {
+    "Meshes/tigger.obj",
+    "Meshes/chevy/chevy.obj",
+    "Meshes/chevy/chassis.obj",
+    "Meshes/chevy/wheel.obj",
+    "Meshes/heart/heart.obj" };
+
+int BenchmarkMeshLoading(int iterations)
+{
+    double totalTextMs = 0, totalProcessMs = 0, totalCacheMs = 0;
+    printf("%-28s %15s %12s %12s %12s\n", "mesh", "", "text", "process", "cache");
+    for(int i = 0; i < sizeof(meshAssets) / sizeof(meshAssets[0]); i++)
+    {
+        MeshData mesh;
+        if(!BuildMesh(meshAssets[i], meshBuildFlags, mesh, false)) return 1;
+        int nTriangles = mesh.lods[0].nIndices / 3;
+
+        bool cached = MeshCache::Write(meshAssets[i], mesh, meshBuildFlags);
+
+        // without build flags BuildMesh only parses and indexes the text
+        MeshData parsed;
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        for(int j = 0; j < iterations; j++)
+        {
+            BuildMesh(meshAssets[i], 0, parsed, false);
+        }
+        std::chrono::duration<double, std::milli> textElapsed = std::chrono::high_resolution_clock::now() - start;
+
+        start = std::chrono::high_resolution_clock::now();
+        for(int j = 0; j < iterations; j++)
+        {
+            BuildMesh(meshAssets[i], meshBuildFlags, mesh, false);
+        }
+        std::chrono::duration<double, std::milli> buildElapsed = std::chrono::high_resolution_clock::now() - start;
+
+        // every page of the mapping is touched, as glBufferData would
+        volatile float checksum = 0;
+        start = std::chrono::high_resolution_clock::now();
+        for(int j = 0; cached && j < iterations; j++)
+        {
+            MeshCache cache;
+            if(!cache.Open(meshAssets[i])) { cached = false; break; }
+            const MeshVertex* v = (const MeshVertex*)cache.vertices;
+            for(unsigned int k = 0; k < cache.header->nVertices; k += 4096 / sizeof(MeshVertex)) checksum += v[k].position[0];
+        }
+        std::chrono::duration<double, std::milli> cacheElapsed = std::chrono::high_resolution_clock::now() - start;
+
+        double textMs = textElapsed.count() / iterations;
+        double processMs = std::max(0.0, buildElapsed.count() / iterations - textMs);
+        double cacheMs = cacheElapsed.count() / iterations;
+        totalTextMs += textMs;
+        totalProcessMs += processMs;
+        totalCacheMs += cacheMs;
+        if(cached)
+            printf("%-28s %6d triangles %9.3f ms %9.3f ms %9.3f ms\n", meshAssets[i], nTriangles, textMs, processMs, cacheMs);
+        else
+            printf("%-28s %6d triangles %9.3f ms %9.3f ms %12s\n", meshAssets[i], nTriangles, textMs, processMs, "n/a");
+    }
+    printf("%-28s %15s %9.3f ms %9.3f ms %9.3f ms\n", "total", "", totalTextMs, totalProcessMs, totalCacheMs);
+    return 0;
+}
+
+// the matrix math as it was before the 4-wide path, kept as the baseline
+// of --bench-math
+mat4 MultiplyScalar(const mat4& left, const mat4& right)
+{
+    mat4 result;
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            result.m[i][j] = 0;
+            for (int k = 0; k < 4; k++) result.m[i][j] += left.m[i][k] * right.m[k][j];
+        }
+    }
+    return result;
+}
+
+void ScaleRotationTranslationScalar(vec3 scaling, vec3 orientation, vec3 position, mat4& M, mat4& InvM)
+{
+    mat4 T = mat4(1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  position.x, position.y, position.z, 1);
+    mat4 InvT = mat4(1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  -position.x, -position.y, -position.z, 1);
+    mat4 S = mat4(scaling.x, 0, 0, 0,  0, scaling.y, 0, 0,  0, 0, scaling.z, 0,  0, 0, 0, 1);
+    mat4 InvS = mat4(1/scaling.x, 0, 0, 0,  0, 1/scaling.y, 0, 0,  0, 0, 1/scaling.z, 0,  0, 0, 0, 1);
+    
+    float alpha = orientation.x / 180.0 * M_PI;
+    mat4 Rx = mat4(1, 0, 0, 0,  0, cos(alpha), sin(alpha), 0,  0, -sin(alpha), cos(alpha), 0,  0, 0, 0, 1);
+    mat4 InvRx = mat4(1, 0, 0, 0,  0, cos(alpha), -sin(alpha), 0,  0, sin(alpha), cos(alpha), 0,  0, 0, 0, 1);
+    alpha = orientation.y / 180.0 * M_PI;
+    mat4 Ry = mat4(cos(alpha), 0, sin(alpha), 0,  0, 1, 0, 0,  -sin(alpha), 0, cos(alpha), 0,  0, 0, 0, 1);
+    mat4 InvRy = mat4(cos(alpha), 0, -sin(alpha), 0,  0, 1, 0, 0,  sin(alpha), 0, cos(alpha), 0,  0, 0, 0, 1);
+    alpha = orientation.z / 180.0 * M_PI;
+    mat4 Rz = mat4(cos(alpha), sin(alpha), 0, 0,  -sin(alpha), cos(alpha), 0, 0,  0, 0, 1, 0,  0, 0, 0, 1);
+    mat4 InvRz = mat4(cos(alpha), -sin(alpha), 0, 0,  sin(alpha), cos(alpha), 0, 0,  0, 0, 1, 0,  0, 0, 0, 1);
+    
+    M = MultiplyScalar(MultiplyScalar(MultiplyScalar(MultiplyScalar(S, Rx), Ry), Rz), T);
+    InvM = MultiplyScalar(MultiplyScalar(MultiplyScalar(MultiplyScalar(InvT, InvRz), InvRy), InvRx), InvS);
+}
+
+float MaxDifference(const mat4& a, const mat4& b)
+{
+    float difference = 0;
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++) difference = std::max(difference, (float)fabs(a.m[i][j] - b.m[i][j]));
+    return difference;
+}
+
+int BenchmarkMath(int iterations)
+{
+#if defined(MATH_AVX)
+    const char* path = "AVX";
+#elif defined(MATH_SSE)
+    const char* path = "SSE";
+#elif defined(MATH_NEON)
+    const char* path = "NEON";
+#else
+    const char* path = "scalar";
+#endif
+    
+    // a pool of transforms like the scene's, cycled so the compiler cannot hoist the work
+    const int nTransforms = 256;
+    std::vector<vec3> scalings(nTransforms), orientations(nTransforms), positions(nTransforms);
+    std::vector<mat4> matrices(nTransforms), references(nTransforms), inverses(nTransforms), referenceInverses(nTransforms);
+    srand(1);
+    for(int i = 0; i < nTransforms; i++)
+    {
+        scalings[i] = vec3(0.5, 0.5, 0.5) + vec3::random() * 0.45;
+        orientations[i] = vec3::random() * 180;
+        positions[i] = vec3::random() * 10;
+        matrices[i] = ScaleRotationTranslation(scalings[i], orientations[i], positions[i]);
+        inverses[i] = matrices[i].AffineInverse();
+        ScaleRotationTranslationScalar(scalings[i], orientations[i], positions[i], references[i], referenceInverses[i]);
+    }
+    
+    float productDifference = 0, trsDifference = 0, inverseDifference = 0;
+    for(int i = 0; i < nTransforms; i++)
+    {
+        int j = (i + 1) % nTransforms;
+        productDifference = std::max(productDifference, MaxDifference(matrices[i] * matrices[j], MultiplyScalar(matrices[i], matrices[j])));
+        trsDifference = std::max(trsDifference, MaxDifference(matrices[i], references[i]));
+        inverseDifference = std::max(inverseDifference, MaxDifference(inverses[i], referenceInverses[i]));
+    }
+    
+    volatile float checksum = 0;
+    printf("%-32s %12s %12s   (%d iterations)\n", "operation", "scalar", path, iterations);
+    
+    mat4 product = matrices[0];
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for(int i = 0; i < iterations; i++) product = MultiplyScalar(product, matrices[i % nTransforms]);
+    std::chrono::duration<double, std::nano> scalarElapsed = std::chrono::high_resolution_clock::now() - start;
+    checksum += product.m[0][0];
+    
+    product = matrices[0];
+    start = std::chrono::high_resolution_clock::now();
+    for(int i = 0; i < iterations; i++) product = product * matrices[i % nTransforms];
+    std::chrono::duration<double, std::nano> simdElapsed = std::chrono::high_resolution_clock::now() - start;
+    checksum += product.m[0][0];
+    printf("%-32s %9.2f ns %9.2f ns\n", "mat4 * mat4", scalarElapsed.count() / iterations, simdElapsed.count() / iterations);
+    
+    vec4 point(1, 2, 3, 1);
+    start = std::chrono::high_resolution_clock::now();
+    for(int i = 0; i < iterations; i++)
+    {
+        const mat4& mat = matrices[i % nTransforms];
+        vec4 result;
+        for (int j = 0; j < 4; j++)
+        {
+            result.v[j] = 0;
+            for (int k = 0; k < 4; k++) result.v[j] += point.v[k] * mat.m[k][j];
+        }
+        point = vec4(result.v[0] * 0.5f, result.v[1] * 0.5f, result.v[2] * 0.5f, 1);
+    }
+    scalarElapsed = std::chrono::high_resolution_clock::now() - start;
+    checksum += point.v[0];
+    
+    point = vec4(1, 2, 3, 1);
+    start = std::chrono::high_resolution_clock::now();
+    for(int i = 0; i < iterations; i++)
+    {
+        vec4 result = point * matrices[i % nTransforms];
+        point = vec4(result.v[0] * 0.5f, result.v[1] * 0.5f, result.v[2] * 0.5f, 1);
+    }
+    simdElapsed = std::chrono::high_resolution_clock::now() - start;
+    checksum += point.v[0];
+    printf("%-32s %9.2f ns %9.2f ns\n", "vec4 * mat4", scalarElapsed.count() / iterations, simdElapsed.count() / iterations);
+    
+    mat4 M, InvM;
+    start = std::chrono::high_resolution_clock::now();
+    for(int i = 0; i < iterations; i++)
+    {
+        int k = i % nTransforms;
+        ScaleRotationTranslationScalar(scalings[k], orientations[k], positions[k], M, InvM);
+        checksum += M.m[3][0] + InvM.m[3][0];
+    }
+    scalarElapsed = std::chrono::high_resolution_clock::now() - start;
+    
+    start = std::chrono::high_resolution_clock::now();
+    for(int i = 0; i < iterations; i++)
+    {
+        int k = i % nTransforms;
+        M = ScaleRotationTranslation(scalings[k], orientations[k], positions[k]);
+        InvM = M.AffineInverse();
+        checksum += M.m[3][0] + InvM.m[3][0];
+    }
+    simdElapsed = std::chrono::high_resolution_clock::now() - start;
+    printf("%-32s %9.2f ns %9.2f ns\n", "TRS matrix and inverse", scalarElapsed.count() / iterations, simdElapsed.count() / iterations);
+    
+    printf("max difference: product %g, TRS %g, inverse %g\n", productDifference, trsDifference, inverseDifference);
+    return 0;
+}
+
+// Entities::Move as it was before the 4-wide kernels, kept as the
+// baseline of --bench-physics
+void MoveScalar(Entities& entities, float dt)
+{
+    for(int i = 0; i < entities.Size(); i++) {
+        entities.position[i] = entities.position[i] + entities.velocity[i]*dt;
+        
+        float* angle = &entities.orientation[i].x;
+        const float* rate = &entities.rotationRate[i].x;
+        for(int k = 0; k < 3; k++) {
+            if(rate[k] == 0) continue;
+            float step = rate[k]*dt;
+            angle[k] += step;
+            while(angle[k] >= 360) {
+                angle[k] -= 360;
+            }
+        }
+    }
+}
+
+float MaxDifference(const std::vector<vec3>& a, const std::vector<vec3>& b)
+{
+    float difference = 0;
+    for(int i = 0; i < a.size(); i++)
+        difference = std::max(difference, std::max((float)fabs(a[i].x - b[i].x), std::max((float)fabs(a[i].y - b[i].y), (float)fabs(a[i].z - b[i].z))));
+    return difference;
+}
+
+// times the integration step over synthetic roads of cars with four
+// spinning wheels each, the scalar loop against the 4-wide kernels
+int BenchmarkPhysics(int carCount)
+{
+    int counts[] = { 10000, 100000, 1000000 };
+    int nCounts = 3;
+    if(carCount > 0) {
+        counts[0] = carCount;
+        nCounts = 1;
+    }
+    
+    printf("%-12s %12s %12s %12s %12s\n", "cars", "entities", "scalar", "4-wide", "difference");
+    for(int c = 0; c < nCounts; c++) {
+        Entities scalar;
+        Random random(1);
+        for(int i = 0; i < counts[c]; i++) {
+            int car = scalar.Add(vec3(-1.5 + i % 4, -0.7, -6 - random.NextInt(14)), vec3(), vec3(), vec3(), OBSTACLE, false);
+            scalar.velocity[car].z = random.NextInt(4) * 3.0;
+            for(int w = 0; w < 4; w++) scalar.Add(vec3(), vec3(), vec3(180.0, 0.0, 0.0), vec3(), NONE, false);
+        }
+        Entities simd = scalar;
+        
+        // about 50 million entity updates per measurement
+        int ticks = std::max(50000000 / scalar.Size(), 5);
+        
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        for(int t = 0; t < ticks; t++) MoveScalar(scalar, 1.0 / tickRate);
+        std::chrono::duration<double, std::nano> scalarElapsed = std::chrono::high_resolution_clock::now() - start;
+        
+        start = std::chrono::high_resolution_clock::now();
+        for(int t = 0; t < ticks; t++) simd.Move(1.0 / tickRate);
+        std::chrono::duration<double, std::nano> simdElapsed = std::chrono::high_resolution_clock::now() - start;
+        
+        float difference = std::max(MaxDifference(scalar.position, simd.position), MaxDifference(scalar.orientation, simd.orientation));
+        double updates = (double)ticks * scalar.Size();
+        printf("%-12d %12d %9.3f ns %9.3f ns %12g\n", counts[c], scalar.Size(),
+               scalarElapsed.count() / updates, simdElapsed.count() / updates, difference);
+    }
+    printf("(per entity and tick)\n");
+    return 0;
+}
+
+// the same seeded headless game with 1 up to maxThreads threads, collisions
+// taking lives the whole time; every row has to end in the same state
+int BenchmarkThreads(int cars, int maxThreads)
+{
+    if(maxThreads <= 0) maxThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+    carCount = cars;
+    const int ticks = 500;
+    
+    printf("%d cars, %d ticks\n", cars, ticks);
+    printf("%-8s %12s %9s %12s   %-16s\n", "threads", "ticks/s", "speedup", "lives lost", "state");
+    double baseRate = 0;
+    for(int nThreads = 1; nThreads <= maxThreads; nThreads++) {
+        jobs.Start(nThreads);
+        
+        Scene* simulation = new Scene();
+        simulation->Seed(randomSeed);
+        simulation->Initialize(false);
+        const int startLives = 1 << 30;
+        lives = startLives;
+        game_over = false;
+        
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        for(int t = 0; t < ticks; t++) {
+            invincible = false;
+            simulation->BeginTick();
+            simulation->Interact();
+            simulation->Control(1.0 / tickRate, InputState());
+            simulation->Move(1.0 / tickRate);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        
+        double rate = ticks / std::max(elapsed.count(), 1e-9);
+        if(nThreads == 1) baseRate = rate;
+        printf("%-8d %12.0f %8.2fx %12d   %016llx\n", nThreads, rate, rate / baseRate, startLives - lives,
+               simulation->HashState(hashBasis));
+        delete simulation;
+    }
+    return 0;
+}
+
+// the game without a window or GL context, as fast as it runs: for
+// measuring and checking the simulation on machines without a display
+int RunHeadless(int ticks)
+{
+    invincible = true;
+    lives = 6;
+    scene.Seed(randomSeed);
+    scene.Initialize(false);
+    
+    // the game keeps running after it is over, as it does in the window
+    int gameOverTick = -1;
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for(int i = 0; i < ticks; i++)
+    {
+        SimulationTick(1.0 / tickRate);
+        if(game_over && gameOverTick < 0) gameOverTick = i + 1;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+    
+    printf("%d ticks (%.1f s of play at %.0f Hz) in %.3f s: %.0f ticks/s\n",
+           ticks, simulationTime, tickRate, elapsed.count(), ticks / std::max(elapsed.count(), 1e-9));
+    if(gameOverTick >= 0)
+        printf("score %d, game over at tick %d\n", score, gameOverTick);
+    else
+        printf("score %d, lives %d\n", score, lives);
+    
+    unsigned long long state = scene.HashState(hashBasis);
+    int counters[3] = { score, lives, (int)game_over };
+    printf("seed %llu, state %016llx\n", randomSeed, HashBytes(state, counters, sizeof(counters)));
+    return 0;
+}
+
 int main(int argc, char * argv[])
 {
+    bool seedGiven = false;
+    int threadCount = 0;
+    const char* recordFilename = 0;
+    const char* replayFilename = 0;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--packed-vertices") == 0) sceneVertexFormat = PACKED_VERTEX;
+        if(strcmp(argv[i], "--no-mesh-optimization") == 0) meshBuildFlags &= ~OPTIMIZE_VERTEX_CACHE;
+        if(strcmp(argv[i], "--no-lods") == 0) meshBuildFlags &= ~GENERATE_LODS;
+        if(strcmp(argv[i], "--no-shadow-proxies") == 0) meshBuildFlags &= ~GENERATE_SHADOW_PROXY;
+        if(strcmp(argv[i], "--lod-threshold") == 0 && i + 1 < argc) lodErrorThreshold = atof(argv[++i]);
+        if(strcmp(argv[i], "--cars") == 0 && i + 1 < argc) carCount = std::max(atoi(argv[++i]), 0);
+        if(strcmp(argv[i], "--tick-rate") == 0 && i + 1 < argc) tickRate = std::max(atof(argv[++i]), 1.0);
+        if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc) { randomSeed = strtoull(argv[++i], 0, 10); seedGiven = true; }
+        if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) recordFilename = argv[++i];
+        if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replayFilename = argv[++i];
+        if(strcmp(argv[i], "--render-stats") == 0) printRenderStats = true;
+        if(strcmp(argv[i], "--shadow-map") == 0) shadowMode = SHADOW_MAP;
+        if(strcmp(argv[i], "--shadow-map-size") == 0 && i + 1 < argc) shadowMapSize = std::max(atoi(argv[++i]), 16);
+        if(strcmp(argv[i], "--bench-shadows") == 0) {
+            shadowBenchmarkFrames = i + 1 < argc && argv[i + 1][0] != '-' ? std::max(atoi(argv[++i]), 2) : 300;
+            shadowMode = PLANAR_SHADOWS;
+        }
+        if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threadCount = std::max(atoi(argv[++i]), 1);
+    }
+    
+    // a replay runs with the settings it was recorded with
+    if(replayFilename) {
+        if(!inputReplay.Open(replayFilename)) {
+            printf("cannot read input recording %s\n", replayFilename);
+            return 1;
+        }
+        randomSeed = inputReplay.header.seed;
+        tickRate = inputReplay.header.tickRate;
+        carCount = inputReplay.header.carCount;
+        seedGiven = true;
+    }
+    bool headless = argc > 1 && (strcmp(argv[1], "--simulate") == 0 || strcmp(argv[1], "--bench-threads") == 0);
+    if(!seedGiven) randomSeed = headless ? 1 : time(NULL);
+    
+    if(recordFilename && !inputRecorder.Open(recordFilename)) {
+        printf("cannot write input recording %s\n", recordFilename);
+        return 1;
+    }
+    
+    if(argc > 1 && strcmp(argv[1], "--bench-threads") == 0)
+        return BenchmarkThreads(argc > 2 && argv[2][0] != '-' ? atoi(argv[2]) : 20000, threadCount);
+    
+    jobs.Start(threadCount);
+
+    if(argc > 1 && strcmp(argv[1], "--bench-load") == 0)
+        return BenchmarkMeshLoading(argc > 2 && argv[2][0] != '-' ? std::max(atoi(argv[2]), 1) : 100);
+    
+    if(argc > 1 && strcmp(argv[1], "--simulate") == 0)
+        return RunHeadless(argc > 2 && argv[2][0] != '-' ? atoi(argv[2]) :
+                           replayFilename ? inputReplay.header.nTicks : 100000);
+    
+    if(argc > 1 && strcmp(argv[1], "--bench-math") == 0)
+        return BenchmarkMath(argc > 2 && argv[2][0] != '-' ? std::max(atoi(argv[2]), 1) : 10000000);
+    
+    if(argc > 1 && strcmp(argv[1], "--bench-physics") == 0)
+        return BenchmarkPhysics(argc > 2 && argv[2][0] != '-' ? atoi(argv[2]) : 0);
+
     std::string data;
     std::ifstream myfile("best_score.txt");
     myfile >> data;
@@ -1911,7 +5110,8 @@ int main(int argc, char * argv[])
     
     invincible = true;
     lives = 6;
-    srand(time(NULL));
+    printf("random seed %llu\n", randomSeed);
+    scene.Seed(randomSeed);
     glutInit(&argc, argv);
 #if !defined(__APPLE__)
     glutInitContextVersion(majorVersion, minorVersion);
@@ -1938,6 +5138,7 @@ int main(int argc, char * argv[])
     printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
     
     onInitialization();
+    simulationThread.Start();
     
     glutDisplayFunc(onDisplay);
     glutIdleFunc(onIdle);